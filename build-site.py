@@ -1,9 +1,44 @@
 import glob
+import gzip
+import hashlib
 import json
 import mimetypes
 import os
 import subprocess
 
+# API endpoints, routed through the same table as the site files. The handler
+# names refer to HttpServerConnection::handle<Name> methods in main.cpp, for
+# GET, POST and PATCH in that order. POST and PATCH handlers are called once
+# the request headers are done.
+API_ROUTES = {
+    "/api/image": ("GetImage", "PostImage", "PatchImage"),
+    "/api/gain": ("GetGain", "PostGain", None),
+    "/api/rotation": ("GetRotation", "PostRotation", None),
+    "/api/time": ("GetTime", "PostTime", None),
+    "/api/now": ("GetNow", None, None),
+    "/api/stats": ("GetStats", None, None),
+    "/api/profile": ("GetProfile", None, None),
+}
+
+
+def route_hash(name, seed):
+    # 32-bit FNV-1a with a seed, matching site_route_hash below.
+    h = 2166136261 ^ seed
+    for b in name.encode():
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def perfect_hash(names):
+    size = 1
+    while size < 2 * len(names):
+        size *= 2
+    for seed in range(1, 1 << 24):
+        slots = {route_hash(name, seed) & (size - 1) for name in names}
+        if len(slots) == len(names):
+            return (size, seed)
+    raise RuntimeError("no perfect hash seed found")
+
 
 def main():
     subprocess.check_call(["pnpm", "run", "build"])
@@ -25,12 +60,17 @@ def main():
             "  size_t length;\n"
             "  const char* type;\n"
             "  const char* encoding;\n"
+            "  size_t gzip_offset;\n"
+            "  size_t gzip_length;\n"
+            "  const char* etag;\n"
+            "  const char* cache_control;\n"
             "};\n"
             "\n"
             "static const struct site_entry site_table[] = {\n"
         )
 
-        for name in glob.iglob("dist/**", recursive=True):
+        files = []
+        for name in sorted(glob.iglob("dist/**", recursive=True)):
             if os.path.isfile(name):
                 (type, encoding) = mimetypes.guess_type(name)
 
@@ -40,19 +80,119 @@ def main():
                     length = len(fb)
                     raw.extend(fb)
 
+                # Also store a gzip copy for clients that accept it, unless the
+                # file is already encoded or would not get any smaller.
+                gzip_offset = 0
+                gzip_length = 0
+                if not encoding:
+                    gz = gzip.compress(fb, compresslevel=9, mtime=0)
+                    if len(gz) < len(fb):
+                        gzip_offset = len(raw)
+                        gzip_length = len(gz)
+                        raw.extend(gz)
+
+                site_name = name.removeprefix("dist")
+                files.append(site_name)
+                etag = hashlib.sha256(fb).hexdigest()[:16]
+
+                # Vite puts a content hash in the names of everything under
+                # /assets/, so those never change. Anything else must be
+                # revalidated with its ETag.
+                if site_name.startswith("/assets/"):
+                    cache_control = "public, max-age=31536000, immutable"
+                else:
+                    cache_control = "no-cache"
+
                 fields = [
                     # JSON string encoding is close enough to C for our purposes.
-                    json.dumps(name.removeprefix("dist")),
+                    json.dumps(site_name),
                     str(offset),
                     str(length),
-                    json.dumps(type),
+                    json.dumps(type or "application/octet-stream"),
                     json.dumps(encoding) if encoding else "NULL",
+                    str(gzip_offset),
+                    str(gzip_length),
+                    json.dumps(etag),
+                    json.dumps(cache_control),
                 ]
                 dst.write("  {" + ", ".join(fields) + "},\n")
 
-        dst.write("  {NULL, 0, 0, NULL, NULL}")
+        dst.write("  {NULL, 0, 0, NULL, NULL, 0, 0, NULL, NULL}")
         dst.write("};\n\n")
 
+        # Route every API endpoint and site file through a perfect hash table,
+        # with directories routed to their index.html.
+        routes = {}
+        for i, name in enumerate(files):
+            routes[name] = (i, None, None, None)
+            if name.endswith("/index.html"):
+                directory = name.removesuffix("index.html")
+                routes.setdefault(directory, (i, None, None, None))
+                if directory != "/":
+                    parent = directory.removesuffix("/")
+                    routes.setdefault(parent, (i, None, None, None))
+        for name, methods in API_ROUTES.items():
+            routes[name] = (None, *methods)
+
+        handlers = sorted(
+            {h for (_, *methods) in routes.values() for h in methods if h}
+        )
+        (size, seed) = perfect_hash(list(routes))
+
+        dst.write("#define SITE_HANDLERS(X) \\\n")
+        for handler in handlers:
+            dst.write(f"  X({handler}) \\\n")
+        dst.write("\n")
+        dst.write(
+            "#define SITE_HANDLER_ID(name) SITE_HANDLER_##name,\n"
+            "enum site_handler { SITE_HANDLERS(SITE_HANDLER_ID) };\n"
+            "#undef SITE_HANDLER_ID\n"
+            "\n"
+            "struct site_route {\n"
+            "  const char* name;\n"
+            "  const struct site_entry* file;\n"
+            "  int get;\n"
+            "  int post;\n"
+            "  int patch;\n"
+            "};\n"
+            "\n"
+            f"#define SITE_ROUTES_SIZE ({size})\n"
+            f"#define SITE_ROUTES_SEED ({seed}u)\n"
+            "\n"
+            "static inline uint32_t site_route_hash(const char* name) {\n"
+            "  uint32_t h = 2166136261u ^ SITE_ROUTES_SEED;\n"
+            "  while (*name) {\n"
+            "    h = (h ^ (uint8_t)*name++) * 16777619u;\n"
+            "  }\n"
+            "  return h;\n"
+            "}\n"
+            "\n"
+            "static const struct site_route site_routes[SITE_ROUTES_SIZE] = {\n"
+        )
+
+        slots = ["  {NULL, NULL, -1, -1, -1}"] * size
+        for name, (file, *methods) in routes.items():
+            fields = [
+                json.dumps(name),
+                f"&site_table[{file}]" if file is not None else "NULL",
+            ] + [f"SITE_HANDLER_{h}" if h else "-1" for h in methods]
+            slots[route_hash(name, seed) & (size - 1)] = (
+                "  {" + ", ".join(fields) + "}"
+            )
+        dst.write(",\n".join(slots))
+        dst.write("};\n\n")
+
+        # Unknown paths get the app, so it can handle its own routing.
+        fallback = "NULL"
+        for name in ["/index.html", "/404.html"]:
+            if name in files:
+                fallback = f"&site_table[{files.index(name)}]"
+                break
+        dst.write(
+            f"static const struct site_entry* const site_fallback = {fallback};\n"
+            "\n"
+        )
+
         dst.write("static const uint8_t site_data[] = {\n")
 
         for i in range(0, len(raw)):
@@ -0,0 +1,76 @@
+#ifndef NATIVE_HAL_ADAFRUIT_PROTOMATTER_H_
+#define NATIVE_HAL_ADAFRUIT_PROTOMATTER_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+
+// An RGB565 canvas, with the subset of Adafruit_GFX used by the firmware.
+class GFXcanvas16 {
+ public:
+  GFXcanvas16(uint16_t width, uint16_t height)
+      : width_(width), height_(height), buffer_(width * height) {}
+
+  uint16_t* getBuffer() { return buffer_.data(); }
+
+  int16_t width() const { return width_; }
+  int16_t height() const { return height_; }
+
+  void drawPixel(int16_t x, int16_t y, uint16_t color) {
+    if (x >= 0 && x < width_ && y >= 0 && y < height_) {
+      buffer_[y * width_ + x] = color;
+    }
+  }
+
+  void fillScreen(uint16_t color) {
+    std::fill(buffer_.begin(), buffer_.end(), color);
+  }
+
+ private:
+  int16_t width_;
+  int16_t height_;
+  std::vector<uint16_t> buffer_;
+};
+
+enum ProtomatterStatus {
+  PROTOMATTER_OK,
+};
+
+// Instead of driving a panel, show() copies the canvas to an in-memory
+// framebuffer that the host can inspect.
+class Adafruit_Protomatter : public GFXcanvas16 {
+ public:
+  Adafruit_Protomatter(uint16_t width,
+                       uint8_t /* bit_depth */,
+                       uint8_t rgb_count,
+                       uint8_t* /* rgb_list */,
+                       uint8_t addr_count,
+                       uint8_t* /* addr_list */,
+                       uint8_t /* clock_pin */,
+                       uint8_t /* latch_pin */,
+                       uint8_t /* oe_pin */,
+                       bool /* double_buffer */,
+                       int8_t tile = 1,
+                       void* /* timer */ = NULL)
+      : GFXcanvas16(width, rgb_count * (2 << addr_count) * abs(tile)),
+        shown_(width * rgb_count * (2 << addr_count) * abs(tile)) {}
+
+  ProtomatterStatus begin() { return PROTOMATTER_OK; }
+
+  void show() {
+    std::copy(getBuffer(), getBuffer() + shown_.size(), shown_.begin());
+    frames_++;
+  }
+
+  uint32_t getFrameCount() const { return frames_; }
+
+  // The last canvas passed to show().
+  const uint16_t* getShownBuffer() const { return shown_.data(); }
+
+ private:
+  std::vector<uint16_t> shown_;
+  uint32_t frames_ = 0;
+};
+
+#endif  // NATIVE_HAL_ADAFRUIT_PROTOMATTER_H_
@@ -0,0 +1,155 @@
+#include "Adafruit_SPIFlash.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+static const char* getEnv(const char* name, const char* fallback) {
+  const char* value = getenv(name);
+  return value && *value ? value : fallback;
+}
+
+bool Adafruit_SPIFlash::begin() {
+  const char* path = getEnv("BILLBOARD_FLASH_IMAGE", "flash.img");
+  fd_ = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0 || ftruncate(fd_, size()) < 0) {
+    Serial.printf("native: cannot open flash image %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+bool Adafruit_SPIFlash::readBlocks(uint32_t block,
+                                   uint8_t* dst,
+                                   size_t blocks) {
+  size_t size = blocks * 512;
+  return pread(fd_, dst, size, block * 512) == (ssize_t)size;
+}
+
+bool Adafruit_SPIFlash::writeBlocks(uint32_t block,
+                                    const uint8_t* src,
+                                    size_t blocks) {
+  size_t size = blocks * 512;
+  return pwrite(fd_, src, size, block * 512) == (ssize_t)size;
+}
+
+bool Adafruit_SPIFlash::syncBlocks() {
+  return fsync(fd_) == 0;
+}
+
+// Paths are relative to the root of the volume either way.
+static std::string hostPath(const FatVolume* volume, const char* path) {
+  return std::string(volume->root()) + "/" + path;
+}
+
+bool File32::open(FatVolume* volume, const char* path, oflag_t flags) {
+  file_.reset();
+  if (!volume->root()) {
+    return false;
+  }
+
+  int fd = ::open(hostPath(volume, path).c_str(), flags, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  const char* mode = "rb";
+  if ((flags & O_ACCMODE) == O_WRONLY) {
+    mode = "wb";
+  } else if ((flags & O_ACCMODE) == O_RDWR) {
+    mode = "r+b";
+  }
+  FILE* file = fdopen(fd, mode);
+  if (!file) {
+    ::close(fd);
+    return false;
+  }
+  file_.reset(file, fclose);
+  return true;
+}
+
+bool File32::close() {
+  bool ok = file_ && fflush(file_.get()) == 0;
+  file_.reset();
+  return ok;
+}
+
+int File32::available() {
+  if (!file_) {
+    return 0;
+  }
+  long pos = ftell(file_.get());
+  return pos < 0 ? 0 : size() - pos;
+}
+
+int File32::read() {
+  return file_ ? fgetc(file_.get()) : -1;
+}
+
+int File32::peek() {
+  if (!file_) {
+    return -1;
+  }
+  int c = fgetc(file_.get());
+  if (c != EOF) {
+    ungetc(c, file_.get());
+  }
+  return c;
+}
+
+int File32::read(void* buffer, size_t size) {
+  if (!file_) {
+    return -1;
+  }
+  size_t n = fread(buffer, 1, size, file_.get());
+  return n > 0 || !ferror(file_.get()) ? (int)n : -1;
+}
+
+size_t File32::write(const uint8_t* buffer, size_t size) {
+  return file_ ? fwrite(buffer, 1, size, file_.get()) : 0;
+}
+
+uint32_t File32::size() const {
+  struct stat st;
+  if (!file_ || fstat(fileno(file_.get()), &st) < 0) {
+    return 0;
+  }
+  // Writes may still be buffered.
+  long pos = ftell(file_.get());
+  return pos > st.st_size ? pos : st.st_size;
+}
+
+bool File32::getModifyDateTime(uint16_t* date, uint16_t* time) {
+  struct stat st;
+  struct tm tm;
+  if (!file_ || fflush(file_.get()) != 0 ||
+      fstat(fileno(file_.get()), &st) < 0 || !localtime_r(&st.st_mtime, &tm)) {
+    return false;
+  }
+  // FAT timestamps, which have a resolution of two seconds.
+  *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  return true;
+}
+
+bool FatVolume::begin(Adafruit_SPIFlash*) {
+  root_ = getEnv("BILLBOARD_FLASH_DIR", "flash");
+  if (mkdir(root_, 0755) < 0 && errno != EEXIST) {
+    Serial.printf("native: cannot create %s\n", root_);
+    root_ = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool FatVolume::exists(const char* path) {
+  struct stat st;
+  return root_ && stat(hostPath(this, path).c_str(), &st) == 0;
+}
+
+bool FatVolume::remove(const char* path) {
+  return root_ && unlink(hostPath(this, path).c_str()) == 0;
+}
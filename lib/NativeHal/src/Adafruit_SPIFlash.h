@@ -0,0 +1,86 @@
+#ifndef NATIVE_HAL_ADAFRUIT_SPIFLASH_H_
+#define NATIVE_HAL_ADAFRUIT_SPIFLASH_H_
+
+#include <fcntl.h>
+#include <memory>
+
+#include "Arduino.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef int oflag_t;
+
+class Adafruit_FlashTransport_QSPI {};
+
+// The raw flash is a 2 MB image file, named by $BILLBOARD_FLASH_IMAGE or
+// flash.img by default. It is only used for USB mass storage on the device.
+class Adafruit_SPIFlash {
+ public:
+  explicit Adafruit_SPIFlash(Adafruit_FlashTransport_QSPI*) {}
+
+  bool begin();
+
+  uint32_t pageSize() const { return 256; }
+  uint32_t numPages() const { return 8192; }
+  uint32_t size() const { return pageSize() * numPages(); }
+
+  bool readBlocks(uint32_t block, uint8_t* dst, size_t blocks);
+  bool writeBlocks(uint32_t block, const uint8_t* src, size_t blocks);
+  bool syncBlocks();
+
+ private:
+  int fd_ = -1;
+};
+
+class FatVolume;
+
+// A file in the volume's host directory.
+class File32 : public Stream {
+ public:
+  bool open(FatVolume* volume, const char* path, oflag_t flags = O_RDONLY);
+  bool close();
+
+  operator bool() const { return file_ != nullptr; }
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  int read(void* buffer, size_t size);
+
+  size_t write(uint8_t x) override { return write(&x, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override;
+
+  uint32_t size() const;
+  bool getModifyDateTime(uint16_t* date, uint16_t* time);
+
+ private:
+  std::shared_ptr<FILE> file_;
+};
+
+// The FAT volume is a host directory, named by $BILLBOARD_FLASH_DIR or flash
+// by default, so its files can be edited directly. Send SIGHUP to have the
+// firmware reload them, as it would after a USB write.
+class FatVolume {
+ public:
+  bool begin(Adafruit_SPIFlash*);
+
+  File32 open(const char* path, oflag_t flags = O_RDONLY) {
+    File32 file;
+    file.open(this, path, flags);
+    return file;
+  }
+
+  bool exists(const char* path);
+  bool remove(const char* path);
+
+  void cacheClear() {}
+
+  const char* root() const { return root_; }
+
+ private:
+  const char* root_ = NULL;
+};
+
+#endif  // NATIVE_HAL_ADAFRUIT_SPIFLASH_H_
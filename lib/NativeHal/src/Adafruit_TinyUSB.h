@@ -0,0 +1,37 @@
+#ifndef NATIVE_HAL_ADAFRUIT_TINYUSB_H_
+#define NATIVE_HAL_ADAFRUIT_TINYUSB_H_
+
+#include "Arduino.h"
+
+// Hosts have no USB drive, but the flush callback is kept so SIGHUP can stand
+// in for the end of a USB write.
+class Adafruit_USBD_MSC {
+ public:
+  typedef int32_t (*ReadCallback)(uint32_t lba, void* buffer, uint32_t size);
+  typedef int32_t (*WriteCallback)(uint32_t lba,
+                                   uint8_t* buffer,
+                                   uint32_t size);
+  typedef void (*FlushCallback)();
+
+  void setID(const char*, const char*, const char*) {}
+  void setCapacity(uint32_t, uint32_t) {}
+  void setUnitReady(bool) {}
+  bool begin() { return true; }
+
+  void setReadWriteCallback(ReadCallback, WriteCallback, FlushCallback flush) {
+    flush_callback = flush;
+  }
+
+  static FlushCallback flush_callback;
+};
+
+class Adafruit_USBD_Device {
+ public:
+  bool mounted() { return false; }
+  bool detach() { return true; }
+  bool attach() { return true; }
+};
+
+extern Adafruit_USBD_Device TinyUSBDevice;
+
+#endif  // NATIVE_HAL_ADAFRUIT_TINYUSB_H_
@@ -0,0 +1,62 @@
+#include "Arduino.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "Adafruit_TinyUSB.h"
+
+HardwareSerial Serial;
+Adafruit_USBD_Device TinyUSBDevice;
+Adafruit_USBD_MSC::FlushCallback Adafruit_USBD_MSC::flush_callback = NULL;
+
+static const std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void delay(unsigned long ms) {
+  usleep(ms * 1000);
+}
+
+void yield() {}
+
+// Tests in test/ build the firmware in and have their own main().
+#ifndef UNIT_TEST
+
+static volatile sig_atomic_t flash_changed = 0;
+
+static void handleSighup(int) {
+  flash_changed = 1;
+}
+
+void setup();
+void loop();
+
+int main() {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGHUP, handleSighup);
+
+  setup();
+  while (true) {
+    loop();
+    if (flash_changed && Adafruit_USBD_MSC::flush_callback) {
+      flash_changed = 0;
+      Adafruit_USBD_MSC::flush_callback();
+    }
+  }
+}
+
+#endif  // UNIT_TEST
@@ -0,0 +1,165 @@
+#ifndef NATIVE_HAL_ARDUINO_H_
+#define NATIVE_HAL_ARDUINO_H_
+
+// The parts of the Arduino core that the firmware uses, implemented for a
+// Linux host. ARDUINO is deliberately left undefined, so shared headers can
+// tell they are in a host build.
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <type_traits>
+
+#define PI 3.1415926535897932384626433832795
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// Templates rather than the usual macros, so they don't break the standard
+// library headers that a host build pulls in. The result is a copy, since
+// the conditional is a reference to a parameter when both types match.
+template <typename A, typename B>
+inline auto min(A a, B b) ->
+    typename std::decay<decltype(a < b ? a : b)>::type {
+  return b < a ? b : a;
+}
+
+template <typename A, typename B>
+inline auto max(A a, B b) ->
+    typename std::decay<decltype(a < b ? a : b)>::type {
+  return a < b ? b : a;
+}
+
+template <typename T, typename L, typename H>
+inline T constrain(T x, L low, H high) {
+  return x < low ? low : (x > high ? high : x);
+}
+
+class Print {
+ public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t x) = 0;
+
+  virtual size_t write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (n < size && write(buffer[n])) {
+      n++;
+    }
+    return n;
+  }
+
+  size_t write(const char* str) {
+    return str ? write(reinterpret_cast<const uint8_t*>(str), strlen(str)) : 0;
+  }
+
+  size_t write(const char* buffer, size_t size) {
+    return write(reinterpret_cast<const uint8_t*>(buffer), size);
+  }
+
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+
+  size_t print(const char* str) { return write(str); }
+  size_t print(char c) { return write(static_cast<uint8_t>(c)); }
+  size_t print(int x) { return printf("%d", x); }
+  size_t print(unsigned int x) { return printf("%u", x); }
+  size_t print(long x) { return printf("%ld", x); }
+  size_t print(unsigned long x) { return printf("%lu", x); }
+  size_t print(double x, int digits = 2) { return printf("%.*f", digits, x); }
+
+  size_t println(const char* str) { return print(str) + print("\r\n"); }
+
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (n < 0) {
+      return n;
+    }
+    return write(buffer, min((size_t)n, sizeof(buffer) - 1));
+  }
+
+  int getWriteError() { return write_error_; }
+  void setWriteError(int error = 1) { write_error_ = error; }
+  void clearWriteError() { write_error_ = 0; }
+
+ private:
+  int write_error_ = 0;
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  // Hosts never wait for bytes that are not already available.
+  size_t readBytes(char* buffer, size_t size) {
+    size_t n = 0;
+    int c;
+    while (n < size && (c = read()) >= 0) {
+      buffer[n++] = static_cast<char>(c);
+    }
+    return n;
+  }
+
+  size_t readBytes(uint8_t* buffer, size_t size) {
+    return readBytes(reinterpret_cast<char*>(buffer), size);
+  }
+
+  void setTimeout(unsigned long) {}
+};
+
+// Serial output goes to stdout.
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  operator bool() { return true; }
+
+  size_t write(uint8_t x) override { return fputc(x, stdout) == EOF ? 0 : 1; }
+
+  size_t write(const uint8_t* buffer, size_t size) override {
+    return fwrite(buffer, 1, size, stdout);
+  }
+
+  void flush() override { fflush(stdout); }
+
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+class IPAddress {
+ public:
+  IPAddress() : IPAddress(0, 0, 0, 0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes_{a, b, c, d} {}
+
+  uint8_t operator[](int i) const { return bytes_[i]; }
+
+  size_t printTo(Print& dst) const {
+    return dst.printf("%u.%u.%u.%u", bytes_[0], bytes_[1], bytes_[2],
+                      bytes_[3]);
+  }
+
+ private:
+  uint8_t bytes_[4];
+};
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+#endif  // NATIVE_HAL_ARDUINO_H_
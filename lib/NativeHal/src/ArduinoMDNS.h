@@ -0,0 +1,15 @@
+#ifndef NATIVE_HAL_ARDUINO_MDNS_H_
+#define NATIVE_HAL_ARDUINO_MDNS_H_
+
+#include "WiFiUdp.h"
+
+// Host builds are reached by address, so the name is not advertised.
+class MDNS {
+ public:
+  explicit MDNS(UDP&) {}
+
+  int begin(const IPAddress&, const char*) { return 1; }
+  void run() {}
+};
+
+#endif  // NATIVE_HAL_ARDUINO_MDNS_H_
@@ -0,0 +1,6 @@
+#ifndef NATIVE_HAL_PRINT_H_
+#define NATIVE_HAL_PRINT_H_
+
+#include "Arduino.h"
+
+#endif  // NATIVE_HAL_PRINT_H_
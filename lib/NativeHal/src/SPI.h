@@ -0,0 +1,6 @@
+#ifndef NATIVE_HAL_SPI_H_
+#define NATIVE_HAL_SPI_H_
+
+#include "Arduino.h"
+
+#endif  // NATIVE_HAL_SPI_H_
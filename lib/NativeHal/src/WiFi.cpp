@@ -0,0 +1,148 @@
+#include "WiFi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+
+// Sockets that are open, across all copies of their WiFiClient handles, and
+// whether available() has handed each to the firmware, which then owns it.
+static std::map<int, bool> open_clients;
+
+static int reserved_sockets = 0;
+
+void wifiReserveSocket() {
+  reserved_sockets++;
+}
+
+void wifiReleaseSocket() {
+  reserved_sockets--;
+}
+
+int WiFiClient::available() {
+  int n = 0;
+  if (!*this || ioctl(fd_, FIONREAD, &n) < 0) {
+    return 0;
+  }
+  return n;
+}
+
+int WiFiClient::read() {
+  uint8_t x;
+  return read(&x, 1) == 1 ? x : -1;
+}
+
+int WiFiClient::peek() {
+  uint8_t x;
+  if (!*this || recv(fd_, &x, 1, MSG_PEEK | MSG_DONTWAIT) != 1) {
+    return -1;
+  }
+  return x;
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+  if (!*this) {
+    return -1;
+  }
+  ssize_t n = recv(fd_, buffer, size, MSG_DONTWAIT);
+  return n > 0 ? n : -1;
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+  if (!*this) {
+    return 0;
+  }
+  ssize_t n = send(fd_, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  return n > 0 ? n : 0;
+}
+
+uint8_t WiFiClient::connected() {
+  if (!*this) {
+    return 0;
+  }
+  // Still connected while unread data remains, as on the device.
+  uint8_t x;
+  ssize_t n = recv(fd_, &x, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+void WiFiClient::stop() {
+  if (*this) {
+    open_clients.erase(fd_);
+    close(fd_);
+  }
+  fd_ = -1;
+}
+
+WiFiClient::operator bool() const {
+  return fd_ >= 0 && open_clients.count(fd_);
+}
+
+void WiFiServer::begin() {
+  if (fd_ >= 0) {
+    return;
+  }
+
+  uint16_t port = port_ < 1024 ? port_ + 8000 : port_;
+  fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(fd_, 8) < 0) {
+    Serial.printf("native: cannot listen on port %u\n", port);
+    close(fd_);
+    fd_ = -1;
+    return;
+  }
+  fcntl(fd_, F_SETFL, O_NONBLOCK);
+  wifiReserveSocket();
+  Serial.printf("native: listening on port %u\n", port);
+}
+
+WiFiClient WiFiServer::available() {
+  if (fd_ < 0) {
+    return WiFiClient();
+  }
+
+  // The ESP32 only buffers a few KB for each socket, which can be simulated
+  // by limiting the send buffer.
+  const char* sndbuf = getenv("BILLBOARD_SOCKET_BUFFER");
+  int fd;
+  while ((int)open_clients.size() + reserved_sockets < WIFI_MAX_SOCK_NUM &&
+         (fd = accept(fd_, NULL, NULL)) >= 0) {
+    if (sndbuf && *sndbuf) {
+      int size = atoi(sndbuf);
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    open_clients[fd] = false;
+  }
+
+  for (auto it = open_clients.begin(); it != open_clients.end();) {
+    WiFiClient client(it->first);
+    if (!it->second && !client.connected()) {
+      close(it->first);
+      it = open_clients.erase(it);
+    } else if (client.available() > 0) {
+      it->second = true;
+      return client;
+    } else {
+      ++it;
+    }
+  }
+  return WiFiClient();
+}
+
+unsigned long WiFiClass::getTime() {
+  return time(NULL);
+}
@@ -0,0 +1,75 @@
+#ifndef NATIVE_HAL_WIFI_H_
+#define NATIVE_HAL_WIFI_H_
+
+#include "Arduino.h"
+
+// The ESP32 has this many sockets, shared by servers, UDP and clients.
+#define WIFI_MAX_SOCK_NUM (10)
+
+// Counts the sockets held by servers and UDP, which leave fewer for clients.
+void wifiReserveSocket();
+void wifiReleaseSocket();
+
+// WiFiNINA connection states.
+enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL,
+  WL_SCAN_COMPLETED,
+  WL_CONNECTED,
+  WL_CONNECT_FAILED,
+  WL_CONNECTION_LOST,
+  WL_DISCONNECTED,
+};
+
+// A TCP socket on the host. Like a WiFiNINA socket number, copies are handles
+// to the same socket, and all of them are invalid once any one is stopped.
+// Writes never block, so short writes happen as they would on the ESP32.
+class WiFiClient : public Stream {
+ public:
+  WiFiClient() {}
+  explicit WiFiClient(int fd) : fd_(fd) {}
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  int read(uint8_t* buffer, size_t size);
+
+  size_t write(uint8_t x) override { return write(&x, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override;
+
+  uint8_t connected();
+  void stop();
+
+  operator bool() const;
+  bool operator==(const WiFiClient& other) const { return fd_ == other.fd_; }
+
+ private:
+  int fd_ = -1;
+};
+
+// Listens on all interfaces. Privileged ports are moved up by 8000, so the
+// web server is on port 8080.
+class WiFiServer {
+ public:
+  explicit WiFiServer(uint16_t port) : port_(port) {}
+
+  void begin();
+
+  // Returns a connected client with unread data, if there is one. As on the
+  // ESP32, connections beyond the socket limit wait to be accepted, and
+  // sockets closed before they ever had data are dropped.
+  WiFiClient available();
+
+ private:
+  uint16_t port_;
+  int fd_ = -1;
+};
+
+class WiFiClass {
+ public:
+  unsigned long getTime();
+  void disconnect() {}
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+};
+
+#endif  // NATIVE_HAL_WIFI_H_
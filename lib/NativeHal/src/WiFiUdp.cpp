@@ -0,0 +1,85 @@
+#include "WiFiUdp.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "WiFi.h"
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+  stop();
+
+  uint16_t host_port = port < 1024 ? port + 8000 : port;
+  fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  int one = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(host_port);
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    Serial.printf("native: cannot bind udp port %u\n", host_port);
+    close(fd_);
+    fd_ = -1;
+    return 0;
+  }
+  fcntl(fd_, F_SETFL, O_NONBLOCK);
+  wifiReserveSocket();
+  Serial.printf("native: receiving on udp port %u\n", host_port);
+  return 1;
+}
+
+void WiFiUDP::stop() {
+  if (fd_ >= 0) {
+    close(fd_);
+    wifiReleaseSocket();
+  }
+  fd_ = -1;
+  packet_size_ = 0;
+  packet_pos_ = 0;
+}
+
+int WiFiUDP::parsePacket() {
+  // Any unread part of the previous packet is discarded.
+  packet_size_ = 0;
+  packet_pos_ = 0;
+  if (fd_ < 0) {
+    return 0;
+  }
+
+  sockaddr_in addr = {};
+  socklen_t addr_size = sizeof(addr);
+  ssize_t n = recvfrom(fd_, packet_, sizeof(packet_), 0,
+                       reinterpret_cast<sockaddr*>(&addr), &addr_size);
+  if (n <= 0) {
+    return 0;
+  }
+  uint32_t ip = ntohl(addr.sin_addr.s_addr);
+  remote_ip_ = IPAddress(ip >> 24, ip >> 16, ip >> 8, ip);
+  remote_port_ = ntohs(addr.sin_port);
+  packet_size_ = n;
+  if (truncate_ >= 0) {
+    packet_size_ = min(packet_size_, truncate_);
+    truncate_ = -1;
+  }
+  return n;
+}
+
+int WiFiUDP::read() {
+  uint8_t x;
+  return read(&x, 1) == 1 ? x : -1;
+}
+
+int WiFiUDP::peek() {
+  return available() > 0 ? packet_[packet_pos_] : -1;
+}
+
+int WiFiUDP::read(uint8_t* buffer, size_t size) {
+  size_t n = min(size, (size_t)available());
+  memcpy(buffer, packet_ + packet_pos_, n);
+  packet_pos_ += n;
+  return n;
+}
@@ -0,0 +1,44 @@
+#ifndef NATIVE_HAL_WIFI_UDP_H_
+#define NATIVE_HAL_WIFI_UDP_H_
+
+#include "Arduino.h"
+
+class UDP : public Stream {};
+
+// Receives datagrams on a host socket, one packet at a time as on the device.
+// Ports below 1024 are moved up by 8000, as for WiFiServer. Nothing is sent.
+class WiFiUDP : public UDP {
+ public:
+  ~WiFiUDP() { stop(); }
+
+  uint8_t begin(uint16_t port);
+  void stop();
+
+  int parsePacket();
+  int available() override { return packet_size_ - packet_pos_; }
+  int read() override;
+  int peek() override;
+  int read(uint8_t* buffer, size_t size);
+
+  int beginPacket(IPAddress, uint16_t) { return 0; }
+  size_t write(uint8_t) override { return 0; }
+  int endPacket() { return 0; }
+
+  IPAddress remoteIP() { return remote_ip_; }
+  uint16_t remotePort() { return remote_port_; }
+
+  // Only lets the first size bytes of the next packet be read, although
+  // parsePacket() reports all of it, as when a transfer from the ESP32 fails.
+  void truncateNextPacket(int size) { truncate_ = size; }
+
+ private:
+  int fd_ = -1;
+  uint8_t packet_[65536];
+  int packet_size_ = 0;
+  int packet_pos_ = 0;
+  IPAddress remote_ip_;
+  uint16_t remote_port_ = 0;
+  int truncate_ = -1;
+};
+
+#endif  // NATIVE_HAL_WIFI_UDP_H_
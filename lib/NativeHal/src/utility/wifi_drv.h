@@ -0,0 +1,21 @@
+#ifndef NATIVE_HAL_UTILITY_WIFI_DRV_H_
+#define NATIVE_HAL_UTILITY_WIFI_DRV_H_
+
+#include "../WiFi.h"
+
+// The host is always on the network, whatever it is asked to join.
+class WiFiDrv {
+ public:
+  static uint8_t getConnectionStatus() { return WL_CONNECTED; }
+
+  static int8_t wifiSetPassphrase(const char*,
+                                  uint8_t,
+                                  const char*,
+                                  const uint8_t) {
+    return 1;
+  }
+
+  static int8_t disconnect() { return 1; }
+};
+
+#endif  // NATIVE_HAL_UTILITY_WIFI_DRV_H_
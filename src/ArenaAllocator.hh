@@ -0,0 +1,155 @@
+#ifndef ARENA_ALLOCATOR_HH_
+#define ARENA_ALLOCATOR_HH_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <malloc.h>
+
+// Under AddressSanitizer, arena bytes outside live blocks are poisoned, so
+// stray accesses are caught as they would be for heap blocks.
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define ARENA_POISON(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define ARENA_UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define ARENA_POISON(ptr, size) ((void)(ptr), (void)(size))
+#define ARENA_UNPOISON(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+// Hands out ArduinoJson's memory from a fixed buffer instead of the heap, by
+// bumping a pointer. Freed blocks are only reclaimed from the top, and the
+// whole arena is reset once nothing in it is live, so a document that is
+// built and dropped per request never leaves holes behind. When the arena is
+// full, blocks come from the heap instead and are counted as overflows.
+class ArenaAllocator : public ArduinoJson::Allocator {
+ public:
+  ArenaAllocator(uint8_t* buffer, size_t size) : buffer_(buffer), size_(size) {
+    ARENA_POISON(buffer_, size_);
+  }
+
+  // The buffer may be reused, as it is on the stack.
+  ~ArenaAllocator() { ARENA_UNPOISON(buffer_, size_); }
+
+  virtual void* allocate(size_t size) override {
+    size_t block = blockSize(size);
+    if (block > size_ - used_) {
+      overflows_++;
+      return malloc(size);
+    }
+    uint8_t* header = buffer_ + used_;
+    ARENA_UNPOISON(header, kHeaderSize + size);
+    *reinterpret_cast<size_t*>(header) = block;
+    used_ += block;
+    live_ += block;
+    live_count_++;
+    high_water_ = max(high_water_, used_);
+    return header + kHeaderSize;
+  }
+
+  virtual void deallocate(void* ptr) override {
+    if (!contains(ptr)) {
+      free(ptr);
+      return;
+    }
+    uint8_t* header = static_cast<uint8_t*>(ptr) - kHeaderSize;
+    size_t block = *reinterpret_cast<size_t*>(header);
+    ARENA_POISON(header, block);
+    live_ -= block;
+    live_count_--;
+    if (live_count_ == 0) {
+      used_ = 0;
+    } else if (header + block == buffer_ + used_) {
+      used_ -= block;
+    }
+  }
+
+  virtual void* reallocate(void* ptr, size_t size) override {
+    if (!contains(ptr)) {
+      return realloc(ptr, size);
+    }
+    uint8_t* header = static_cast<uint8_t*>(ptr) - kHeaderSize;
+    size_t old_block = *reinterpret_cast<size_t*>(header);
+    size_t block = blockSize(size);
+
+    // The top block grows or shrinks in place, and others only shrink.
+    bool top = header + old_block == buffer_ + used_;
+    if (top && block <= size_ - (header - buffer_)) {
+      ARENA_POISON(header, old_block);
+      ARENA_UNPOISON(header, kHeaderSize + size);
+      *reinterpret_cast<size_t*>(header) = block;
+      used_ = header - buffer_ + block;
+      live_ = live_ - old_block + block;
+      high_water_ = max(high_water_, used_);
+      return ptr;
+    } else if (block <= old_block) {
+      ARENA_POISON(header, old_block);
+      ARENA_UNPOISON(header, kHeaderSize + size);
+      return ptr;
+    }
+
+    void* moved = allocate(size);
+    if (moved) {
+      ARENA_UNPOISON(ptr, old_block - kHeaderSize);
+      memcpy(moved, ptr, old_block - kHeaderSize);
+      deallocate(ptr);
+    }
+    return moved;
+  }
+
+  size_t size() const { return size_; }
+  size_t highWater() const { return high_water_; }
+  size_t live() const { return live_; }
+  // Bytes below the top that were freed but can't be reused yet.
+  size_t wasted() const { return used_ - live_; }
+  uint32_t overflows() const { return overflows_; }
+
+ private:
+  // Keeps every block aligned for any type ArduinoJson stores.
+  static const size_t kAlign = 8;
+  static const size_t kHeaderSize = kAlign;
+
+  static size_t blockSize(size_t size) {
+    return kHeaderSize + (size + kAlign - 1) / kAlign * kAlign;
+  }
+
+  bool contains(const void* ptr) const {
+    const uint8_t* p = static_cast<const uint8_t*>(ptr);
+    return p >= buffer_ && p < buffer_ + size_;
+  }
+
+  uint8_t* buffer_;
+  size_t size_;
+  size_t used_ = 0;
+  size_t live_ = 0;
+  size_t live_count_ = 0;
+  size_t high_water_ = 0;
+  uint32_t overflows_ = 0;
+};
+
+template <size_t kSize>
+class StaticArenaAllocator final : public ArenaAllocator {
+ public:
+  StaticArenaAllocator() : ArenaAllocator(buffer_, kSize) {}
+
+ private:
+  alignas(8) uint8_t buffer_[kSize];
+};
+
+struct HeapInfo {
+  size_t size;
+  size_t used;
+  size_t free;
+};
+
+// The heap is only grown, so on the device its size is its high-water mark,
+// and free bytes within it are left by fragmentation.
+static inline HeapInfo getHeapInfo() {
+#ifdef ARDUINO
+  struct mallinfo info = mallinfo();
+#else
+  struct mallinfo2 info = mallinfo2();
+#endif
+  return {(size_t)info.arena, (size_t)info.uordblks, (size_t)info.fordblks};
+}
+
+#endif  // ARENA_ALLOCATOR_HH_
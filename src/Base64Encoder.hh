@@ -5,7 +5,7 @@
 
 class Base64Encoder : public Print {
  public:
-  Base64Encoder(String& dst) : dst_(dst) {}
+  Base64Encoder(Print& dst) : dst_(dst) {}
 
   ~Base64Encoder() {
     // The Base64Encoder is tiny, so will often be a short-lived
@@ -34,10 +34,11 @@ class Base64Encoder : public Print {
       char output[] = {
           BASE64[63u & (buf_[0] >> 2)],
           BASE64[63u & ((buf_[0] << 4) | (buf_[1] >> 4))],
-          pos_ > 0 ? BASE64[63u & ((buf_[1] << 2) | (buf_[2] >> 6))] : '=',
-          pos_ > 1 ? BASE64[63u & buf_[2]] : '=', '\0'};
+          pos_ > 1 ? BASE64[63u & ((buf_[1] << 2) | (buf_[2] >> 6))] : '=',
+          pos_ > 2 ? BASE64[63u & buf_[2]] : '='};
 
-      if (!dst_.concat(output)) {
+      if (dst_.write(reinterpret_cast<const uint8_t*>(output),
+                     sizeof(output)) != sizeof(output)) {
         setWriteError();
       }
     }
@@ -47,7 +48,7 @@ class Base64Encoder : public Print {
   }
 
  private:
-  String& dst_;
+  Print& dst_;
 
   uint8_t buf_[3];
   size_t pos_ = 0;
@@ -0,0 +1,276 @@
+#ifndef CLOCK_HH_
+#define CLOCK_HH_
+
+#include <Arduino.h>
+
+// Keeps the time of day locally between occasional network time readings, so
+// looking it up is arithmetic on millis() instead of a round trip to the ESP32.
+class Clock {
+ public:
+  // Readings are whole seconds, so are taken to be half way through.
+  void sync(uint32_t seconds, unsigned long ms) {
+    int64_t actual_ms = (int64_t)seconds * 1000 + 500;
+    unsigned long elapsed = ms - sync_ms_;
+    if (valid_ && elapsed >= kDriftIntervalMs) {
+      // Compare how far millis() moved against how far the network time
+      // moved, ignoring steps that look like the network time was changed.
+      int64_t error_ms = actual_ms - millisAt(ms);
+      int32_t ppm = error_ms * 1000000 / (int64_t)elapsed;
+      if (abs(ppm) < kMaxDriftPpm) {
+        drift_ppm_ = constrain(drift_ppm_ + ppm / 4, -kMaxDriftPpm,
+                               kMaxDriftPpm);
+      }
+    }
+    sync_ms_ = ms;
+    sync_time_ms_ = actual_ms;
+    valid_ = true;
+  }
+
+  bool valid() const { return valid_; }
+
+  // Seconds since the epoch at the given millis().
+  int64_t seconds(unsigned long ms) const { return millisAt(ms) / 1000; }
+
+  int32_t driftPpm() const { return drift_ppm_; }
+
+ private:
+  // Drift is only measured over long intervals, since each reading may be
+  // up to a second out.
+  static const unsigned long kDriftIntervalMs = 1800000;
+  static const int32_t kMaxDriftPpm = 2000;
+
+  int64_t millisAt(unsigned long ms) const {
+    int64_t elapsed = (unsigned long)(ms - sync_ms_);
+    return sync_time_ms_ + elapsed + elapsed * drift_ppm_ / 1000000;
+  }
+
+  bool valid_ = false;
+  unsigned long sync_ms_ = 0;
+  int64_t sync_time_ms_ = 0;
+  int32_t drift_ppm_ = 0;
+};
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar.
+static inline int32_t daysFromCivil(int32_t y, int32_t m, int32_t d) {
+  y -= m <= 2;
+  int32_t era = (y >= 0 ? y : y - 399) / 400;
+  int32_t yoe = y - era * 400;
+  int32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static inline int32_t yearFromDays(int32_t days) {
+  days += 719468;
+  int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int32_t doe = days - era * 146097;
+  int32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int32_t mp = (5 * doy + 2) / 153;
+  return yoe + era * 400 + (mp >= 10);
+}
+
+static inline int32_t floorDiv(int64_t a, int32_t b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// A POSIX TZ rule like "AEST-10AEDT,M10.1.0,M4.1.0/3". Offsets are hours west
+// of UTC, and daylight saving starts and ends on the d'th weekday (0 is
+// Sunday) of week w (5 is the last) of month m, at a local time that defaults
+// to 02:00. The daylight saving offset defaults to an hour ahead.
+class Timezone {
+ public:
+  bool parse(const char* tz) {
+    Timezone result;
+    const char* p = tz;
+    if (!p || !parseName(&p) || !parseTime(&p, &result.std_offset_)) {
+      return false;
+    }
+    result.std_offset_ = -result.std_offset_;
+    result.dst_offset_ = result.std_offset_;
+
+    if (*p) {
+      if (!parseName(&p)) {
+        return false;
+      }
+      result.dst_offset_ = result.std_offset_ + 3600;
+      if (*p && *p != ',') {
+        if (!parseTime(&p, &result.dst_offset_)) {
+          return false;
+        }
+        result.dst_offset_ = -result.dst_offset_;
+      }
+      if (*p++ != ',' || !parseRule(&p, &result.start_) || *p++ != ',' ||
+          !parseRule(&p, &result.end_) || *p) {
+        return false;
+      }
+      result.has_dst_ = true;
+    }
+
+    *this = result;
+    return true;
+  }
+
+  // Seconds to add to UTC for local time at the given time.
+  int32_t offset(int64_t utc) {
+    if (!has_dst_) {
+      return std_offset_;
+    }
+
+    int32_t year = yearFromDays(floorDiv(utc + std_offset_, 86400));
+    if (year != cached_year_) {
+      cached_year_ = year;
+      start_utc_ = ruleTime(year, start_) - std_offset_;
+      end_utc_ = ruleTime(year, end_) - dst_offset_;
+    }
+
+    bool dst = start_utc_ < end_utc_
+                   ? utc >= start_utc_ && utc < end_utc_
+                   : utc >= start_utc_ || utc < end_utc_;
+    return dst ? dst_offset_ : std_offset_;
+  }
+
+ private:
+  struct Rule {
+    int32_t month = 0;
+    int32_t week = 0;
+    int32_t day = 0;
+    int32_t time = 7200;
+  };
+
+  static bool parseName(const char** p) {
+    const char* s = *p;
+    if (*s == '<') {
+      const char* end = strchr(s, '>');
+      if (!end) {
+        return false;
+      }
+      *p = end + 1;
+      return true;
+    }
+    while (isalpha(*s)) {
+      s++;
+    }
+    if (s - *p < 3) {
+      return false;
+    }
+    *p = s;
+    return true;
+  }
+
+  // Parses [+-]hh[:mm[:ss]] into seconds.
+  static bool parseTime(const char** p, int32_t* seconds) {
+    const char* s = *p;
+    int32_t sign = 1;
+    if (*s == '+' || *s == '-') {
+      sign = *s++ == '-' ? -1 : 1;
+    }
+    if (!isdigit(*s)) {
+      return false;
+    }
+    int32_t total = 0;
+    for (int32_t scale = 3600; scale >= 1; scale /= 60) {
+      char* end;
+      long n = strtol(s, &end, 10);
+      if (end == s || n < 0 || n > 167) {
+        return false;
+      }
+      total += n * scale;
+      s = end;
+      if (*s != ':' || scale == 1) {
+        break;
+      }
+      s++;
+    }
+    *seconds = sign * total;
+    *p = s;
+    return true;
+  }
+
+  static bool parseRule(const char** p, Rule* rule) {
+    const char* s = *p;
+    char* end;
+    if (*s++ != 'M') {
+      return false;
+    }
+    rule->month = strtol(s, &end, 10);
+    if (end == s || *end != '.' || rule->month < 1 || rule->month > 12) {
+      return false;
+    }
+    s = end + 1;
+    rule->week = strtol(s, &end, 10);
+    if (end == s || *end != '.' || rule->week < 1 || rule->week > 5) {
+      return false;
+    }
+    s = end + 1;
+    rule->day = strtol(s, &end, 10);
+    if (end == s || rule->day < 0 || rule->day > 6) {
+      return false;
+    }
+    s = end;
+    if (*s == '/') {
+      s++;
+      if (!parseTime(&s, &rule->time)) {
+        return false;
+      }
+    }
+    *p = s;
+    return true;
+  }
+
+  // Local seconds since the epoch when the rule applies in the given year.
+  static int64_t ruleTime(int32_t year, const Rule& rule) {
+    int32_t first = daysFromCivil(year, rule.month, 1);
+    int32_t next = rule.month == 12 ? daysFromCivil(year + 1, 1, 1)
+                                    : daysFromCivil(year, rule.month + 1, 1);
+    // 1970-01-01 was a Thursday.
+    int32_t weekday = ((first + 4) % 7 + 7) % 7;
+    int32_t day = first + (rule.day - weekday + 7) % 7 + (rule.week - 1) * 7;
+    while (day >= next) {
+      day -= 7;
+    }
+    return (int64_t)day * 86400 + rule.time;
+  }
+
+  int32_t std_offset_ = 0;
+  int32_t dst_offset_ = 0;
+  bool has_dst_ = false;
+  Rule start_;
+  Rule end_;
+
+  int32_t cached_year_ = 0;
+  int64_t start_utc_ = 0;
+  int64_t end_utc_ = 0;
+};
+
+// Finds the minutes after midnight UTC of sunrise and sunset on the given day,
+// using NOAA's approximate solar equations. Returns false if the sun does not
+// rise or set that day.
+static inline bool getSunTimes(int32_t days,
+                               float latitude,
+                               float longitude,
+                               int* sunrise,
+                               int* sunset) {
+  const float rad = PI / 180;
+  int32_t year = yearFromDays(days);
+  float g = 2 * PI / 365 * (days - daysFromCivil(year, 1, 1));
+  float eqtime = 229.18 * (0.000075 + 0.001868 * cosf(g) - 0.032077 * sinf(g) -
+                           0.014615 * cosf(2 * g) - 0.040849 * sinf(2 * g));
+  float decl = 0.006918 - 0.399912 * cosf(g) + 0.070257 * sinf(g) -
+               0.006758 * cosf(2 * g) + 0.000907 * sinf(2 * g) -
+               0.002697 * cosf(3 * g) + 0.00148 * sinf(3 * g);
+
+  // The zenith of 90.833 degrees allows for refraction and the sun's size.
+  float lat = latitude * rad;
+  float cos_ha = cosf(90.833 * rad) / (cosf(lat) * cosf(decl)) -
+                 tanf(lat) * tanf(decl);
+  if (cos_ha < -1 || cos_ha > 1) {
+    return false;
+  }
+  float ha = acosf(cos_ha) / rad;
+  *sunrise = lroundf(720 - 4 * (longitude + ha) - eqtime);
+  *sunset = lroundf(720 - 4 * (longitude - ha) - eqtime);
+  return true;
+}
+
+#endif  // CLOCK_HH_
@@ -0,0 +1,38 @@
+#ifndef CRC32_HH_
+#define CRC32_HH_
+
+#include <Arduino.h>
+
+// The zlib CRC-32 of everything printed to it, so content can be checked by
+// the same code that writes it out. A 16 entry table keeps it small.
+class Crc32 final : public Print {
+ public:
+  Crc32() {}
+
+  virtual size_t write(uint8_t x) override { return write(&x, 1); }
+
+  virtual size_t write(const uint8_t* ptr, size_t size) override {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    for (size_t i = 0; i < size; i++) {
+      crc_ ^= ptr[i];
+      crc_ = (crc_ >> 4) ^ table[crc_ & 15];
+      crc_ = (crc_ >> 4) ^ table[crc_ & 15];
+    }
+    size_ += size;
+    return size;
+  }
+
+  uint32_t value() const { return ~crc_; }
+  uint32_t size() const { return size_; }
+
+ private:
+  uint32_t crc_ = 0xffffffff;
+  uint32_t size_ = 0;
+};
+
+#endif  // CRC32_HH_
@@ -24,6 +24,9 @@ class FixedBuffer final : public Print {
       return 0;
     }
     size_t n = min(remaining(), size);
+    if (n < size) {
+      setWriteError();
+    }
     memcpy(end(), ptr, n);
     end_ += n;
     return n;
@@ -49,6 +52,20 @@ class FixedBuffer final : public Print {
     }
   }
 
+  // Drops any data after the first size bytes.
+  void truncate(size_t size) {
+    if (size < this->size()) {
+      end_ = begin_ + size;
+    }
+  }
+
+  // Moves the data to the start of the buffer, making room at the end.
+  void compact() {
+    memmove(data_, data_ + begin_, size());
+    end_ -= begin_;
+    begin_ = 0;
+  }
+
   void clear() {
     clearWriteError();
     bzero(data_, kBufferSize);
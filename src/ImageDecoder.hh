@@ -0,0 +1,325 @@
+#ifndef IMAGE_DECODER_HH_
+#define IMAGE_DECODER_HH_
+
+#include <Arduino.h>
+
+// Incrementally decodes an uploaded or stored image into packed RGB pixels, so
+// the input can be consumed in whatever chunks the socket or file delivers.
+//
+// The run-length format is a sequence of packets, each starting with a byte
+// whose top two bits select the operation and whose low six bits hold the
+// number of pixels minus one:
+//
+//   00nnnnnn  n+1 literal pixels follow, three RGB bytes each.
+//   01nnnnnn  The following RGB pixel is repeated n+1 times.
+//   10nnnnnn  n+1 pixels are unchanged from the reference image.
+class ImageDecoder {
+ public:
+  enum Format {
+    FORMAT_RGBA8888,
+    FORMAT_RGB888,
+    FORMAT_RGB565,
+    FORMAT_RLE,
+  };
+
+  // Selects the format from a Content-Type header value, ignoring any
+  // parameters. A missing type is the original raw RGBA upload.
+  static bool parseFormat(const char* type, Format* format) {
+    if (!type) {
+      *format = FORMAT_RGBA8888;
+      return true;
+    }
+
+    size_t len = strcspn(type, "; ");
+    if (matchType(type, len, "application/octet-stream") ||
+        matchType(type, len, "image/x-rgba8888")) {
+      *format = FORMAT_RGBA8888;
+    } else if (matchType(type, len, "image/x-rgb888")) {
+      *format = FORMAT_RGB888;
+    } else if (matchType(type, len, "image/x-rgb565")) {
+      *format = FORMAT_RGB565;
+    } else if (matchType(type, len, "image/x-rgb-rle")) {
+      *format = FORMAT_RLE;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // Returns whether an encoded body of the given length could be valid.
+  static bool checkLength(Format format, size_t length, size_t pixels) {
+    switch (format) {
+      case FORMAT_RGBA8888:
+        return length == pixels * 4;
+      case FORMAT_RGB888:
+        return length == pixels * 3;
+      case FORMAT_RGB565:
+        return length == pixels * 2;
+      case FORMAT_RLE:
+        // Worst case is every pixel in a packet of its own, as a one pixel
+        // literal or repeat. Streams too short are caught by done().
+        return length <= pixels * 4;
+    }
+    return false;
+  }
+
+  // Bytes per decoded pixel.
+  static const size_t kPixelSize = 3;
+
+  // Starts decoding into dst, which must hold the given number of packed RGB
+  // pixels. Skipped pixels are copied from the reference image.
+  void begin(Format format, uint8_t* dst, const uint8_t* ref, size_t pixels) {
+    format_ = format;
+    dst_ = dst;
+    ref_ = ref;
+    pixels_ = pixels;
+    pixel_ = 0;
+    op_ = 0;
+    count_ = 0;
+    pending_ = 0;
+  }
+
+  // Returns false if the input is malformed or overflows the image.
+  bool write(const uint8_t* src, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      if (!put(src[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns whether every pixel has been decoded, with no partial packet.
+  bool done() const {
+    return pixel_ == pixels_ && count_ == 0 && pending_ == 0;
+  }
+
+ private:
+  enum {
+    OP_LITERAL = 0,
+    OP_REPEAT = 1,
+    OP_SKIP = 2,
+  };
+
+  static bool matchType(const char* type, size_t len, const char* expect) {
+    return strlen(expect) == len && strncasecmp(type, expect, len) == 0;
+  }
+
+  bool put(uint8_t x) {
+    if (format_ == FORMAT_RLE && count_ == 0) {
+      op_ = x >> 6;
+      count_ = (x & 63u) + 1;
+      if (op_ > OP_SKIP || count_ > pixels_ - pixel_) {
+        return false;
+      }
+      if (op_ == OP_SKIP) {
+        memcpy(dst_ + pixel_ * kPixelSize, ref_ + pixel_ * kPixelSize,
+               count_ * kPixelSize);
+        pixel_ += count_;
+        count_ = 0;
+      }
+      return true;
+    }
+
+    buf_[pending_++] = x;
+    switch (format_) {
+      case FORMAT_RGBA8888:
+        if (pending_ < 4) {
+          return true;
+        }
+        return emit(buf_[0], buf_[1], buf_[2], 1);
+      case FORMAT_RGB888:
+        if (pending_ < 3) {
+          return true;
+        }
+        return emit(buf_[0], buf_[1], buf_[2], 1);
+      case FORMAT_RGB565: {
+        if (pending_ < 2) {
+          return true;
+        }
+        // Little-endian, expanded by replicating the top bits into the
+        // bottom so full scale stays full scale.
+        uint16_t v = buf_[0] | (buf_[1] << 8);
+        uint8_t r = (v >> 11) & 31u;
+        uint8_t g = (v >> 5) & 63u;
+        uint8_t b = v & 31u;
+        return emit((r << 3) | (r >> 2), (g << 2) | (g >> 4),
+                    (b << 3) | (b >> 2), 1);
+      }
+      case FORMAT_RLE:
+        if (pending_ < 3) {
+          return true;
+        }
+        if (op_ == OP_LITERAL) {
+          count_--;
+          return emit(buf_[0], buf_[1], buf_[2], 1);
+        } else {
+          size_t n = count_;
+          count_ = 0;
+          return emit(buf_[0], buf_[1], buf_[2], n);
+        }
+    }
+    return false;
+  }
+
+  bool emit(uint8_t r, uint8_t g, uint8_t b, size_t n) {
+    pending_ = 0;
+    if (n > pixels_ - pixel_) {
+      return false;
+    }
+    uint8_t* dst = dst_ + pixel_ * kPixelSize;
+    for (size_t i = 0; i < n; i++) {
+      dst[0] = r;
+      dst[1] = g;
+      dst[2] = b;
+      dst += kPixelSize;
+    }
+    pixel_ += n;
+    return true;
+  }
+
+  Format format_ = FORMAT_RGBA8888;
+  uint8_t* dst_ = NULL;
+  const uint8_t* ref_ = NULL;
+  size_t pixels_ = 0;
+  size_t pixel_ = 0;
+
+  uint8_t op_ = 0;
+  size_t count_ = 0;
+
+  uint8_t buf_[4];
+  size_t pending_ = 0;
+};
+
+// Decodes a sequence of rectangles into part of a packed RGB image. Each has a
+// four byte header of x, y, width and height, followed by its pixels a row at
+// a time in one of the formats above, where run-length packets do not span
+// rows and skipped pixels keep their current value. RGB888 rows are copied
+// straight into the image, and other rows are decoded into a buffer and then
+// copied in whole.
+template <size_t kMaxWidth>
+class RectDecoder {
+ public:
+  void begin(ImageDecoder::Format format, size_t width, size_t height) {
+    format_ = format;
+    width_ = width;
+    height_ = height;
+    header_size_ = 0;
+    rect_h_ = 0;
+    row_ = 0;
+    rects_ = 0;
+    dirty_begin_ = height;
+    dirty_end_ = 0;
+  }
+
+  // Returns false if the input is malformed or a rectangle is out of bounds.
+  // Every call for a patch must pass the same image, since each row keeps a
+  // pointer into it as the reference for skip packets.
+  bool write(uint8_t* image, const uint8_t* src, size_t size) {
+    while (size > 0) {
+      if (row_ == rect_h_) {
+        header_[header_size_++] = *src++;
+        size--;
+        if (header_size_ == sizeof(header_) && !beginRect(image)) {
+          return false;
+        }
+        continue;
+      }
+
+      size_t n = 0;
+      bool complete;
+      if (format_ == ImageDecoder::FORMAT_RGB888) {
+        n = min(size, rect_w_ * ImageDecoder::kPixelSize - row_pos_);
+        memcpy(rowStart(image) + row_pos_, src, n);
+        row_pos_ += n;
+        complete = row_pos_ == rect_w_ * ImageDecoder::kPixelSize;
+      } else {
+        while (n < size && !row_decoder_.done()) {
+          if (!row_decoder_.write(src + n, 1)) {
+            return false;
+          }
+          n++;
+        }
+        complete = row_decoder_.done();
+      }
+      src += n;
+      size -= n;
+      if (complete) {
+        finishRow(image);
+      }
+    }
+    return true;
+  }
+
+  // Returns whether at least one rectangle was decoded, with none partial.
+  bool done() const { return rects_ > 0 && header_size_ == 0; }
+
+  // The image rows written so far are [dirtyBegin(), dirtyEnd()).
+  int dirtyBegin() const { return dirty_begin_; }
+  int dirtyEnd() const { return dirty_end_; }
+
+ private:
+  bool beginRect(uint8_t* image) {
+    rect_x_ = header_[0];
+    rect_y_ = header_[1];
+    rect_w_ = header_[2];
+    rect_h_ = header_[3];
+    row_ = 0;
+    if (rect_w_ == 0 || rect_h_ == 0 || rect_w_ > kMaxWidth ||
+        rect_x_ + rect_w_ > width_ || rect_y_ + rect_h_ > height_) {
+      return false;
+    }
+    beginRow(image);
+    return true;
+  }
+
+  uint8_t* rowStart(uint8_t* image) const {
+    return image + ((rect_y_ + row_) * width_ + rect_x_) *
+                       ImageDecoder::kPixelSize;
+  }
+
+  void beginRow(uint8_t* image) {
+    row_pos_ = 0;
+    if (format_ != ImageDecoder::FORMAT_RGB888) {
+      row_decoder_.begin(format_, row_buffer_, rowStart(image), rect_w_);
+    }
+  }
+
+  void finishRow(uint8_t* image) {
+    if (format_ != ImageDecoder::FORMAT_RGB888) {
+      memcpy(rowStart(image), row_buffer_, rect_w_ * ImageDecoder::kPixelSize);
+    }
+    dirty_begin_ = min(dirty_begin_, (int)(rect_y_ + row_));
+    dirty_end_ = max(dirty_end_, (int)(rect_y_ + row_ + 1));
+    row_++;
+    if (row_ < rect_h_) {
+      beginRow(image);
+    } else {
+      header_size_ = 0;
+      rects_++;
+    }
+  }
+
+  ImageDecoder::Format format_ = ImageDecoder::FORMAT_RGB888;
+  size_t width_ = 0;
+  size_t height_ = 0;
+
+  uint8_t header_[4];
+  size_t header_size_ = 0;
+  size_t rect_x_ = 0;
+  size_t rect_y_ = 0;
+  size_t rect_w_ = 0;
+  size_t rect_h_ = 0;
+  size_t rects_ = 0;
+
+  // The current row of the current rectangle.
+  size_t row_ = 0;
+  size_t row_pos_ = 0;
+  ImageDecoder row_decoder_;
+  uint8_t row_buffer_[kMaxWidth * ImageDecoder::kPixelSize];
+
+  int dirty_begin_ = 0;
+  int dirty_end_ = 0;
+};
+
+#endif  // IMAGE_DECODER_HH_
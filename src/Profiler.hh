@@ -0,0 +1,96 @@
+#ifndef PROFILER_HH_
+#define PROFILER_HH_
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#endif
+
+// Aggregates how long sections of code take into a fixed table of count, min,
+// average and max, with a log2 histogram for each entry. Times are counted in
+// CPU cycles from the DWT cycle counter on the device, and in nanoseconds from
+// std::chrono on a host build, so both report the same metrics.
+template <size_t kEntries>
+class Profiler {
+ public:
+  // Bucket 0 counts zero ticks, and bucket b counts [2^(b-1), 2^b) ticks.
+  static const size_t kBuckets = 33;
+
+  struct Entry {
+    uint32_t count = 0;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    uint64_t sum = 0;
+    uint32_t histogram[kBuckets] = {};
+  };
+
+  // Records the time from construction to destruction.
+  class Scope {
+   public:
+    Scope(Profiler& profiler, size_t id)
+        : profiler_(profiler), id_(id), begin_(now()) {}
+
+    ~Scope() { profiler_.record(id_, now() - begin_); }
+
+   private:
+    Profiler& profiler_;
+    size_t id_;
+    uint32_t begin_;
+  };
+
+  // Starts the cycle counter, which is off after reset.
+  static void begin() {
+#if defined(DWT)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+  }
+
+  static uint32_t now() {
+#if defined(DWT)
+    return DWT->CYCCNT;
+#elif defined(ARDUINO)
+    return micros();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  static uint32_t ticksPerSecond() {
+#if defined(DWT)
+    return SystemCoreClock;
+#elif defined(ARDUINO)
+    return 1000000;
+#else
+    return 1000000000;
+#endif
+  }
+
+  void record(size_t id, uint32_t ticks) {
+    Entry& entry = entries_[id];
+    entry.count++;
+    entry.sum += ticks;
+    if (ticks < entry.min) {
+      entry.min = ticks;
+    }
+    if (ticks > entry.max) {
+      entry.max = ticks;
+    }
+    entry.histogram[ticks ? 32 - __builtin_clz(ticks) : 0]++;
+  }
+
+  const Entry& entry(size_t id) const { return entries_[id]; }
+
+  size_t size() const { return kEntries; }
+
+ private:
+  Entry entries_[kEntries];
+};
+
+#endif  // PROFILER_HH_
@@ -0,0 +1,111 @@
+#ifndef SCHEDULER_HH_
+#define SCHEDULER_HH_
+
+#include <Arduino.h>
+
+// Runs a fixed set of tasks from loop(), one per call, so slow work in one task
+// only delays the others by a single run. Of the tasks that are due, the one
+// with the earliest deadline runs first, and higher priority breaks ties.
+template <size_t kTasks>
+class Scheduler {
+ public:
+  typedef void (*Function)();
+
+  struct Task {
+    const char* name = NULL;
+    Function function = NULL;
+    unsigned long period_ms = 0;
+    unsigned long deadline_ms = 0;
+    int priority = 0;
+
+    bool scheduled = false;
+    unsigned long due_ms = 0;
+
+    // A run is missed when it starts more than deadline_ms after it was due.
+    unsigned long runs = 0;
+    unsigned long missed = 0;
+    unsigned long worst_us = 0;
+  };
+
+  // Sets up a task that runs every period_ms starting now, or only when
+  // scheduled if period_ms is zero.
+  void setTask(size_t id,
+               const char* name,
+               Function function,
+               unsigned long period_ms,
+               unsigned long deadline_ms,
+               int priority) {
+    Task& task = tasks_[id];
+    task.name = name;
+    task.function = function;
+    task.period_ms = period_ms;
+    task.deadline_ms = deadline_ms;
+    task.priority = priority;
+    task.scheduled = period_ms > 0;
+    task.due_ms = millis();
+  }
+
+  // Makes a task due after delay_ms, replacing when it was due before.
+  void schedule(size_t id, unsigned long delay_ms) {
+    tasks_[id].scheduled = true;
+    tasks_[id].due_ms = millis() + delay_ms;
+  }
+
+  // Stops a task until it is scheduled again.
+  void cancel(size_t id) { tasks_[id].scheduled = false; }
+
+  // Runs the next due task, and returns whether there was one.
+  bool run() {
+    unsigned long now = millis();
+    Task* next = NULL;
+    for (Task& task : tasks_) {
+      if (task.function && task.scheduled && (long)(now - task.due_ms) >= 0 &&
+          (!next || isBefore(task, *next))) {
+        next = &task;
+      }
+    }
+    if (!next) {
+      return false;
+    }
+
+    Task& task = *next;
+    if (now - task.due_ms > task.deadline_ms) {
+      task.missed++;
+    }
+
+    // Periodic tasks keep their phase unless they fall a whole period behind.
+    // The task may reschedule itself while it runs.
+    if (task.period_ms) {
+      task.due_ms += task.period_ms;
+      if ((long)(now - task.due_ms) >= 0) {
+        task.due_ms = now + task.period_ms;
+      }
+    } else {
+      task.scheduled = false;
+    }
+
+    unsigned long begin_us = micros();
+    task.function();
+    unsigned long us = micros() - begin_us;
+
+    task.runs++;
+    if (us > task.worst_us) {
+      task.worst_us = us;
+    }
+    return true;
+  }
+
+  const Task& task(size_t id) const { return tasks_[id]; }
+
+  size_t size() const { return kTasks; }
+
+ private:
+  static bool isBefore(const Task& a, const Task& b) {
+    long diff = (long)((a.due_ms + a.deadline_ms) - (b.due_ms + b.deadline_ms));
+    return diff < 0 || (diff == 0 && a.priority > b.priority);
+  }
+
+  Task tasks_[kTasks];
+};
+
+#endif  // SCHEDULER_HH_
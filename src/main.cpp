@@ -14,51 +14,322 @@
 // wrapper.
 #include <utility/wifi_drv.h>
 
+#include "ArenaAllocator.hh"
 #include "Base64Encoder.hh"
+#include "Clock.hh"
+#include "Crc32.hh"
 #include "FixedBuffer.hh"
+#include "ImageDecoder.hh"
+#include "Profiler.hh"
+#include "Scheduler.hh"
 
 #include "gen-site.h"
 
+// *** Scheduler ***
+
+// Periodic and deferred work in loop(). Set up in setup(), since the task
+// functions are defined further down.
+enum {
+  TASK_FLASH,
+  TASK_WIFI,
+  TASK_MATRIX,
+  TASK_DAY_NIGHT,
+  TASK_SAVE_IMAGE,
+  TASK_SAVE_FRAMES,
+  TASK_CLOCK,
+  TASK_COUNT,
+};
+
+Scheduler<TASK_COUNT> scheduler;
+
+// *** Profiling ***
+
+// Sections of the hot paths that are timed for /api/profile.
+enum {
+  PROFILE_MATRIX,
+  PROFILE_WIFI,
+  PROFILE_HTTP_READ,
+  PROFILE_HTTP_BODY,
+  PROFILE_HTTP_WRITE,
+  PROFILE_JSON_PARSE,
+  PROFILE_JSON_SERIALIZE,
+  PROFILE_FAT_READ,
+  PROFILE_FAT_WRITE,
+  PROFILE_COUNT,
+};
+
+static const char* const profile_names[PROFILE_COUNT] = {
+    "matrix",     "wifi",           "http_read", "http_body", "http_write",
+    "json_parse", "json_serialize", "fat_read",  "fat_write",
+};
+
+typedef Profiler<PROFILE_COUNT> HotPathProfiler;
+HotPathProfiler profiler;
+
 // *** JSON configuration ***
 
-JsonDocument config_json;
-JsonDocument frames_json;
+// JSON documents take their memory from fixed arenas instead of the heap, so
+// weeks of requests can't fragment it. ArduinoJson's pools of slots are about
+// four times larger on a 64-bit host, so the arenas scale with them.
+#define JSON_ARENA_UNIT (sizeof(void*) == 4 ? 1024 : 4096)
+
+StaticArenaAllocator<2 * JSON_ARENA_UNIT> config_json_arena;
+StaticArenaAllocator<6 * JSON_ARENA_UNIT> frames_json_arena;
+// Documents that only live for one request or task share this arena, which
+// is reset each time they have all been dropped. It also holds the copy made
+// by compactJson(), so it is as large as the largest document arena.
+StaticArenaAllocator<6 * JSON_ARENA_UNIT> temp_json_arena;
+
+JsonDocument config_json(&config_json_arena);
+JsonDocument frames_json(&frames_json_arena);
+
+// Edits to a document leave freed strings and slots behind in its arena, so
+// it is copied out and back in to reclaim them.
+static void compactJson(JsonDocument& doc, ArenaAllocator& arena) {
+  if (arena.wasted() == 0) {
+    return;
+  }
+  JsonDocument copy(&temp_json_arena);
+  copy.set(doc);
+  doc.clear();
+  doc.set(copy);
+}
+
+static void getArenaStats(JsonObject dst, const ArenaAllocator& arena) {
+  dst["size"] = arena.size();
+  dst["high_water"] = arena.highWater();
+  dst["live"] = arena.live();
+  dst["wasted"] = arena.wasted();
+  dst["overflows"] = arena.overflows();
+}
+
+// Schedule times are HMM local time, or follow the sun.
+enum ScheduleKind {
+  SCHEDULE_FIXED,
+  SCHEDULE_SUNRISE,
+  SCHEDULE_SUNSET,
+};
+
+struct ScheduleTime {
+  ScheduleKind kind;
+  int hm;
+};
+
+// The settings from config.json and frames.json, checked and converted once
+// whenever either changes, so everything else reads plain fields. The JSON
+// documents are only used to load and save them.
+struct Settings {
+  // config.json
+  char wifi_ssid[33] = "";
+  char wifi_pass[65] = "";
+  char wifi_name[64] = "";
+
+  // frames.json
+  float gain = 0.5;
+  float gamma = 1.0;
+  // White balance multipliers for red, green and blue.
+  float balance[3] = {1.0, 1.0, 1.0};
+  int rotation = 0;
+  ScheduleTime morning = {SCHEDULE_FIXED, 900};
+  ScheduleTime evening = {SCHEDULE_FIXED, 1600};
+  Timezone timezone;
+  bool has_location = false;
+  float latitude = 0;
+  float longitude = 0;
+};
+
+Settings settings;
+
+static void copySetting(char* dst,
+                        size_t size,
+                        const char* path,
+                        const char* src) {
+  if (src && strlen(src) >= size) {
+    Serial.printf("%lu: %s is too long\n", millis(), path);
+    src = NULL;
+  }
+  strcpy(dst, src ? src : "");
+}
+
+static void loadConfigSettings() {
+  JsonVariantConst wifi = config_json["wifi"];
+  copySetting(settings.wifi_ssid, sizeof(settings.wifi_ssid), "wifi.ssid",
+              wifi["ssid"]);
+  copySetting(settings.wifi_pass, sizeof(settings.wifi_pass), "wifi.pass",
+              wifi["pass"]);
+  copySetting(settings.wifi_name, sizeof(settings.wifi_name), "wifi.name",
+              wifi["name"]);
+}
+
+static ScheduleTime parseScheduleTime(JsonVariantConst value, int fallback) {
+  if (value.is<int>() && value.as<int>() >= 0) {
+    return {SCHEDULE_FIXED, value.as<int>()};
+  } else if (value == "sunrise") {
+    return {SCHEDULE_SUNRISE, fallback};
+  } else if (value == "sunset") {
+    return {SCHEDULE_SUNSET, fallback};
+  }
+  return {SCHEDULE_FIXED, fallback};
+}
+
+static void loadFrameSettings() {
+  JsonVariantConst gain = frames_json["gain"];
+  settings.gain = gain.is<float>() ? gain.as<float>() : 0.5;
+
+  JsonVariantConst gamma = frames_json["gamma"];
+  settings.gamma =
+      gamma.is<float>() && gamma.as<float>() > 0 ? gamma.as<float>() : 1.0;
+
+  for (int i = 0; i < 3; i++) {
+    JsonVariantConst balance = frames_json["balance"][i];
+    settings.balance[i] =
+        balance.is<float>() ? constrain(balance.as<float>(), 0.0, 1.0) : 1.0;
+  }
+
+  int rotation = frames_json["rotation"].as<int>();
+  settings.rotation =
+      rotation == 90 || rotation == 180 || rotation == 270 ? rotation : 0;
 
-bool frames_saving = false;
-unsigned long frames_saving_stamp = 0;
+  settings.morning = parseScheduleTime(frames_json["morning"], 900);
+  settings.evening = parseScheduleTime(frames_json["evening"], 1600);
 
-static float getRequestedGain() {
-  return frames_json["gain"].is<float>() ? frames_json["gain"].as<float>()
-                                         : 0.5;
+  const char* tz = frames_json["timezone"];
+  if (!settings.timezone.parse(tz ? tz : "UTC0")) {
+    Serial.printf("%lu: bad timezone '%s'\n", millis(), tz);
+    settings.timezone.parse("UTC0");
+  }
+
+  JsonVariantConst latitude = frames_json["latitude"];
+  JsonVariantConst longitude = frames_json["longitude"];
+  settings.has_location = latitude.is<float>() && longitude.is<float>();
+  settings.latitude = constrain(latitude.as<float>(), -90.0, 90.0);
+  settings.longitude = constrain(longitude.as<float>(), -180.0, 180.0);
+}
+
+// *** Clock ***
+
+// Network time, kept between syncs.
+Clock wall_clock;
+
+// Converts seconds since local midnight to HMM.
+static int secondsToHoursMinutes(int32_t seconds) {
+  return seconds / 3600 * 100 + seconds / 60 % 60;
+}
+
+// Returns the local time of day as HMM, or -1 if it is not known yet.
+static int getHoursMinutes() {
+  if (!wall_clock.valid()) {
+    return -1;
+  }
+  int64_t utc = wall_clock.seconds(millis());
+  int64_t local = utc + settings.timezone.offset(utc);
+  return secondsToHoursMinutes(local - (int64_t)floorDiv(local, 86400) * 86400);
+}
+
+// Returns today's local sunrise or sunset as HMM, or -1 if the time or
+// location is not known, or the sun does not rise or set today.
+static int getSunHoursMinutes(bool sunrise) {
+  if (!wall_clock.valid() || !settings.has_location) {
+    return -1;
+  }
+
+  int64_t utc = wall_clock.seconds(millis());
+  int32_t offset = settings.timezone.offset(utc);
+  int rise, set;
+  if (!getSunTimes(floorDiv(utc + offset, 86400), settings.latitude,
+                   settings.longitude, &rise, &set)) {
+    return -1;
+  }
+  int32_t minutes = ((sunrise ? rise : set) + offset / 60) % 1440;
+  return secondsToHoursMinutes((minutes + 1440) % 1440 * 60);
 }
 
-static int getRotation() {
-  return frames_json["rotation"].is<int>() ? frames_json["rotation"].as<int>()
-                                           : 0;
+// Sun times fall back to the default HMM when they are not known.
+static int getScheduleTime(const ScheduleTime& time) {
+  int hm = -1;
+  if (time.kind != SCHEDULE_FIXED) {
+    hm = getSunHoursMinutes(time.kind == SCHEDULE_SUNRISE);
+  }
+  return hm >= 0 ? hm : time.hm;
 }
 
 static int getMorning() {
-  return frames_json["morning"].is<int>() ? frames_json["morning"].as<int>()
-                                          : 900;
+  return getScheduleTime(settings.morning);
 }
 
 static int getEvening() {
-  return frames_json["evening"].is<int>() ? frames_json["evening"].as<int>()
-                                          : 1600;
+  return getScheduleTime(settings.evening);
 }
 
 // *** LED Matrix ***
 
 #define IMAGE_WIDTH (64)
 #define IMAGE_HEIGHT (64)
-uint8_t image_bin[IMAGE_HEIGHT][IMAGE_WIDTH][4];
-
-bool image_saving = false;
-unsigned long image_saving_stamp = 0;
+#define IMAGE_PIXELS (IMAGE_WIDTH * IMAGE_HEIGHT)
+
+// Images are held in memory as packed RGB. The original RGBA layout is still
+// used for image files on the flash and for GET /api/image, and is converted
+// on the way in and out.
+typedef uint8_t Image[IMAGE_HEIGHT][IMAGE_WIDTH][3];
+#define IMAGE_FILE_SIZE (IMAGE_PIXELS * 4)
+
+// The image being displayed, and a back buffer that ingest paths (uploads,
+// patches, streams, animation frames and flash reloads) fill before swapping
+// it in, so image_bin only ever holds whole frames. While an upload, patch or
+// stream is writing into the back buffer it is claimed by image_back_owner.
+Image image_buffers[2];
+Image* image_bin = &image_buffers[0];
+Image* image_back = &image_buffers[1];
+const void* image_back_owner = NULL;
 
 bool image_showing = false;
-unsigned long image_showing_stamp = 0;
-unsigned long image_refresh_stamp = 0;
+
+// Bumped by every writer of image_bin or of the settings that change how it is
+// drawn, so the renderer can skip frames where nothing changed. Only the image
+// rows in [render_dirty_begin, render_dirty_end) are redrawn.
+uint32_t render_generation = 1;
+uint32_t render_generation_drawn = 0;
+int render_dirty_begin = 0;
+int render_dirty_end = IMAGE_HEIGHT;
+
+unsigned long render_frames_drawn = 0;
+unsigned long render_frames_skipped = 0;
+
+// Present latency runs from the first change after a frame was drawn until
+// the next frame is on the panel.
+unsigned long render_ingest_us = 0;
+uint64_t render_present_sum_us = 0;
+unsigned long render_present_max_us = 0;
+
+static void markRowsDirty(int begin, int end) {
+  if (render_generation == render_generation_drawn) {
+    render_ingest_us = micros();
+  }
+  render_dirty_begin = min(render_dirty_begin, max(begin, 0));
+  render_dirty_end = max(render_dirty_end, min(end, IMAGE_HEIGHT));
+  render_generation++;
+}
+
+static void markAllDirty() {
+  markRowsDirty(0, IMAGE_HEIGHT);
+}
+
+// Only the given rows need to be redrawn, if the rest of the back buffer is
+// known to match.
+static void swapImageBuffers(int dirty_begin = 0,
+                             int dirty_end = IMAGE_HEIGHT) {
+  Image* front = image_back;
+  image_back = image_bin;
+  image_bin = front;
+  markRowsDirty(dirty_begin, dirty_end);
+}
+
+static void setImageShowing(bool showing) {
+  if (showing != image_showing) {
+    image_showing = showing;
+    markAllDirty();
+  }
+}
 
 // BUG: The Protomatter library requires the pin arrays to be non-const.
 Adafruit_Protomatter matrix(
@@ -71,7 +342,7 @@ Adafruit_Protomatter matrix(
     14,                               // Clock pin.
     15,                               // Latch pin.
     16,                               // Output enable pin.
-    false,                            // Double buffered.
+    true,                             // Double buffered.
     -2  // Two matrix panels in serpentine arrangement.
 );
 
@@ -79,45 +350,114 @@ static void setupMatrix() {
   matrix.begin();
   matrix.fillScreen(0);
   matrix.show();
+  render_generation_drawn = render_generation;
+}
+
+// Lookup tables from 8-bit image channels to the canvas RGB565 fields, with
+// the gain, gamma curve and white balance already applied. Rebuilt only when
+// one of those settings changes.
+static uint16_t matrix_lut_red[256];
+static uint16_t matrix_lut_green[256];
+static uint16_t matrix_lut_blue[256];
+static bool matrix_lut_stale = true;
+
+static void buildMatrixLut(uint16_t* lut,
+                           int bits,
+                           int shift,
+                           float scale,
+                           float gamma) {
+  const float levels = (1 << bits) - 1;
+  for (int i = 0; i < 256; i++) {
+    // Round to the nearest level, where color565 would truncate.
+    float value = constrain(scale * powf(i / 255.0f, gamma), 0, 1);
+    lut[i] = (uint16_t)(value * levels + 0.5f) << shift;
+  }
+}
+
+static void updateMatrixLut() {
+  if (!matrix_lut_stale) {
+    return;
+  }
+  matrix_lut_stale = false;
+
+  const float gain = settings.gain;
+  const float gamma = settings.gamma;
+  buildMatrixLut(matrix_lut_red, 5, 11, gain * settings.balance[0], gamma);
+  buildMatrixLut(matrix_lut_green, 6, 5, gain * settings.balance[1], gamma);
+  buildMatrixLut(matrix_lut_blue, 5, 0, gain * settings.balance[2], gamma);
+}
+
+// Walks the canvas in image order for a given rotation, matching the
+// transform that GFXcanvas16::drawPixel would apply for each pixel.
+struct MatrixScan {
+  int start;
+  int step_x;
+  int step_y;
+};
+
+static MatrixScan getMatrixScan(int rotation) {
+  const int w = IMAGE_WIDTH;
+  const int h = IMAGE_HEIGHT;
+  if (rotation == 90) {
+    return {w - 1, w, -1};
+  } else if (rotation == 180) {
+    return {w * h - 1, -1, -w};
+  } else if (rotation == 270) {
+    return {w * (h - 1), -w, 1};
+  } else {
+    return {0, 1, w};
+  }
 }
 
 static void loopMatrix() {
   // DEBUG: Serial.printf("%lu: %d\n", millis(), (int)image_show);
+  if (render_generation == render_generation_drawn) {
+    render_frames_skipped++;
+    return;
+  }
+  HotPathProfiler::Scope profile(profiler, PROFILE_MATRIX);
+
   if (image_showing) {
     // TODO: High gain when insifficiently powered (like over USB from a laptop)
     // will cause voltage drop and system crashes. Consider always starting the
     // actual gain at zero and slowly increasing until we hit the requested
     // limit or see power ripples.
-    float gain = getRequestedGain();
+    updateMatrixLut();
 
     // TODO: Automatic rotation based on the accelerometer would be cool.
     // TODO: Consider using the DMA to scan out lines and avoid the sleep-based
     // library.
 
-    int rotation = getRotation();
-    if (rotation == 90)
-      matrix.setRotation(1);
-    else if (rotation == 180)
-      matrix.setRotation(2);
-    else if (rotation == 270)
-      matrix.setRotation(3);
-    else
-      matrix.setRotation(0);
-
-    for (int y = 0; y < IMAGE_HEIGHT; y++) {
+    // Write straight into the canvas rather than through drawPixel, which
+    // would repeat the rotation transform and bounds checks for every pixel.
+    const MatrixScan scan = getMatrixScan(settings.rotation);
+    uint16_t* canvas = matrix.getBuffer();
+    for (int y = render_dirty_begin; y < render_dirty_end; y++) {
+      const uint8_t* rgb = (*image_bin)[y][0];
+      uint16_t* dst = canvas + scan.start + y * scan.step_y;
       for (int x = 0; x < IMAGE_WIDTH; x++) {
-        const uint8_t* rgba = image_bin[y][x];
-        uint8_t r = constrain(rgba[0] * gain, 0, 255);
-        uint8_t g = constrain(rgba[1] * gain, 0, 255);
-        uint8_t b = constrain(rgba[2] * gain, 0, 255);
-        matrix.drawPixel(x, y, matrix.color565(r, g, b));
+        *dst = matrix_lut_red[rgb[0]] | matrix_lut_green[rgb[1]] |
+               matrix_lut_blue[rgb[2]];
+        rgb += 3;
+        dst += scan.step_x;
       }
     }
   } else {
     matrix.fillScreen(0);
   }
 
+  // The canvas is converted into the bitplanes that are not being scanned
+  // out, and show() waits for the end of the current refresh to swap them in,
+  // so the panel never shows a frame half-written.
   matrix.show();
+
+  unsigned long latency = micros() - render_ingest_us;
+  render_present_sum_us += latency;
+  render_present_max_us = max(render_present_max_us, latency);
+  render_generation_drawn = render_generation;
+  render_dirty_begin = IMAGE_HEIGHT;
+  render_dirty_end = 0;
+  render_frames_drawn++;
 }
 
 // *** SPI flash and USB mass storage device ***
@@ -173,28 +513,650 @@ static void setupFlash() {
   }
 }
 
+static void expandImageRow(const Image* src, int y, uint8_t* rgba) {
+  const uint8_t* rgb = (*src)[y][0];
+  for (int x = 0; x < IMAGE_WIDTH; x++) {
+    rgba[0] = rgb[0];
+    rgba[1] = rgb[1];
+    rgba[2] = rgb[2];
+    rgba[3] = 255;
+    rgba += 4;
+    rgb += 3;
+  }
+}
+
+static bool readImageFile(File32& file, Image* dst) {
+  if (file.size() != IMAGE_FILE_SIZE) {
+    return false;
+  }
+  HotPathProfiler::Scope profile(profiler, PROFILE_FAT_READ);
+
+  ImageDecoder decoder;
+  decoder.begin(ImageDecoder::FORMAT_RGBA8888, &(*dst)[0][0][0], NULL,
+                IMAGE_PIXELS);
+  uint8_t chunk[512];
+  int n;
+  while ((n = file.read(chunk, sizeof(chunk))) > 0) {
+    if (!decoder.write(chunk, n)) {
+      return false;
+    }
+  }
+  return decoder.done();
+}
+
+static bool writeImageFile(Print& file, const Image* src) {
+  uint8_t rgba[IMAGE_WIDTH * 4];
+  for (int y = 0; y < IMAGE_HEIGHT; y++) {
+    expandImageRow(src, y, rgba);
+    if (file.write(rgba, sizeof(rgba)) != sizeof(rgba)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Files are saved by first writing the new content to a journal, ending with
+// its size and CRC, then copying it over the file and removing the journal.
+// Losing power part way through leaves either the old file and an incomplete
+// journal, which is discarded, or a complete journal, which is copied again.
+// Content that matches the last save, going by its CRC, is not written again.
+struct SavedFile {
+  const char* path;
+  const char* journal_path;
+  bool known;
+  uint32_t crc;
+  uint32_t size;
+};
+
+SavedFile image_file = {"/image.bin", "/image.jnl", false, 0, 0};
+SavedFile frames_file = {"/frames.json", "/frames.jnl", false, 0, 0};
+
+// Reads size bytes of file into dst, which may be NULL to only check them.
+static bool copyFileBytes(File32& file, uint32_t size, Print* dst, Crc32* crc) {
+  uint8_t chunk[512];
+  while (size > 0) {
+    int n = file.read(chunk, min(size, sizeof(chunk)));
+    if (n <= 0 || (dst && dst->write(chunk, n) != (size_t)n)) {
+      return false;
+    }
+    crc->write(chunk, n);
+    size -= n;
+  }
+  return true;
+}
+
+static bool checkFile(const char* path, const Crc32& expected) {
+  File32 file = flash_fat.open(path, O_BINARY | O_RDONLY);
+  Crc32 actual;
+  bool ok = file && file.size() == expected.size() &&
+            copyFileBytes(file, expected.size(), NULL, &actual);
+  file.close();
+  return ok && actual.value() == expected.value();
+}
+
+// Copies a complete journal over its file and removes it, or removes an
+// incomplete one. Returns whether the file now has the journal's content.
+static bool applyJournal(SavedFile* saved) {
+  HotPathProfiler::Scope profile(profiler, PROFILE_FAT_WRITE);
+  File32 journal = flash_fat.open(saved->journal_path, O_BINARY | O_RDONLY);
+  Crc32 content;
+  uint32_t trailer[2] = {0, 0};
+  bool complete =
+      journal && journal.size() >= sizeof(trailer) &&
+      copyFileBytes(journal, journal.size() - sizeof(trailer), NULL,
+                    &content) &&
+      journal.read(trailer, sizeof(trailer)) == sizeof(trailer) &&
+      trailer[0] == content.size() && trailer[1] == content.value();
+  journal.close();
+
+  bool ok = false;
+  if (complete) {
+    journal = flash_fat.open(saved->journal_path, O_BINARY | O_RDONLY);
+    File32 file =
+        flash_fat.open(saved->path, O_BINARY | O_CREAT | O_TRUNC | O_WRONLY);
+    Crc32 copied;
+    ok = journal && file &&
+         copyFileBytes(journal, content.size(), &file, &copied);
+    ok = file.close() && ok;
+    journal.close();
+    ok = ok && checkFile(saved->path, content);
+  }
+  if (complete && !ok) {
+    // Keep the journal to try again after a reset.
+    return false;
+  }
+  flash_fat.remove(saved->journal_path);
+
+  saved->known = ok;
+  saved->crc = content.value();
+  saved->size = content.size();
+  return ok;
+}
+
+// Finishes a save that was interrupted by a reset.
+static void recoverFile(SavedFile* saved) {
+  if (flash_fat.exists(saved->journal_path)) {
+    Serial.printf("%lu: %s %s\n", millis(),
+                  applyJournal(saved) ? "recovered" : "discarded",
+                  saved->path);
+  }
+}
+
+template <typename Writer>
+static void rememberFile(SavedFile* saved, Writer write) {
+  Crc32 content;
+  saved->known = write(content);
+  saved->crc = content.value();
+  saved->size = content.size();
+}
+
+// Saves whatever write(Print&) produces, unless it matches the last save.
+template <typename Writer>
+static void saveFile(SavedFile* saved, Writer write) {
+  Crc32 content;
+  if (!write(content)) {
+    Serial.printf("%lu: error writing %s\n", millis(), saved->path);
+    return;
+  }
+  if (saved->known && saved->crc == content.value() &&
+      saved->size == content.size()) {
+    Serial.printf("%lu: unchanged %s\n", millis(), saved->path);
+    return;
+  }
+
+  Serial.printf("%lu: writing %s\n", millis(), saved->path);
+  File32 journal = flash_fat.open(saved->journal_path,
+                                  O_BINARY | O_CREAT | O_TRUNC | O_WRONLY);
+  bool ok = false;
+  if (journal) {
+    HotPathProfiler::Scope profile(profiler, PROFILE_FAT_WRITE);
+    uint32_t trailer[2] = {content.size(), content.value()};
+    ok = write(journal) &&
+         journal.write((const uint8_t*)trailer, sizeof(trailer)) ==
+             sizeof(trailer);
+    ok = journal.close() && ok;
+  }
+  if (!(ok && applyJournal(saved))) {
+    Serial.printf("%lu: error writing %s\n", millis(), saved->path);
+    saved->known = false;
+  }
+}
+
+static bool writeImage(Print& out) {
+  return writeImageFile(out, image_bin);
+}
+
+static bool writeFrames(Print& out) {
+  HotPathProfiler::Scope profile(profiler, PROFILE_JSON_SERIALIZE);
+  return serializeJsonPretty(frames_json, out) > 0;
+}
+
+// *** Animation ***
+
+// The "frames" array in frames.json lists raw image files on the flash, each
+// with a duration in milliseconds. The next frame is streamed from the flash
+// into image_back a chunk at a time while the current frame is on screen, so
+// at most two frames are held in SRAM no matter how long the sequence is.
+#define ANIMATION_MIN_DURATION_MS (33)
+// The chunk is read onto the stack once per loop(), so it is kept small. A
+// frame still loads in 16 passes, well within the shortest duration.
+#define ANIMATION_CHUNK_SIZE (1024)
+
+bool animation_playing = false;
+size_t animation_index = 0;
+size_t animation_loaded = 0;
+unsigned long animation_due_us = 0;
+File32 animation_file;
+ImageDecoder animation_decoder;
+
+// Lateness of each frame relative to its scheduled start, to show whether HTTP
+// or flash I/O is holding up the loop.
+unsigned long animation_frames_shown = 0;
+unsigned long animation_frames_dropped = 0;
+uint64_t animation_jitter_sum_us = 0;
+unsigned long animation_jitter_max_us = 0;
+
+static void stopAnimation() {
+  animation_playing = false;
+  animation_file.close();
+}
+
+static void startAnimation() {
+  stopAnimation();
+  animation_playing = frames_json["frames"].size() > 0;
+  animation_index = 0;
+  animation_loaded = 0;
+  animation_due_us = micros();
+}
+
+// Called when an upload claims image_back, so the partially streamed frame has
+// to be loaded again.
+static void interruptAnimation() {
+  animation_file.close();
+  animation_loaded = 0;
+}
+
+static unsigned long getFrameDuration(JsonVariant frame) {
+  unsigned long duration =
+      frame["duration"].is<unsigned long>()
+          ? frame["duration"].as<unsigned long>()
+          : 1000;
+  return max(duration, (unsigned long)ANIMATION_MIN_DURATION_MS);
+}
+
+static void loopAnimation() {
+  if (!animation_playing || !image_showing || image_back_owner) {
+    return;
+  }
+
+  JsonArray frames = frames_json["frames"];
+  if (frames.size() == 0) {
+    stopAnimation();
+    return;
+  }
+  JsonVariant frame = frames[animation_index];
+
+  // Stream the next frame into the back buffer.
+  if (animation_loaded < IMAGE_FILE_SIZE) {
+    if (!animation_file) {
+      const char* path = frame["path"];
+      animation_file = flash_fat.open(path ? path : "", O_BINARY | O_RDONLY);
+      if (!animation_file || animation_file.size() != IMAGE_FILE_SIZE) {
+        Serial.printf("%lu: failed animation frame %s\n", millis(), path);
+        stopAnimation();
+        return;
+      }
+      animation_decoder.begin(ImageDecoder::FORMAT_RGBA8888,
+                              &(*image_back)[0][0][0], NULL, IMAGE_PIXELS);
+    }
+
+    uint8_t chunk[ANIMATION_CHUNK_SIZE];
+    int n;
+    {
+      HotPathProfiler::Scope profile(profiler, PROFILE_FAT_READ);
+      n = animation_file.read(
+          chunk, min(IMAGE_FILE_SIZE - animation_loaded, sizeof(chunk)));
+    }
+    if (n <= 0 || !animation_decoder.write(chunk, n)) {
+      Serial.printf("%lu: error reading animation frame\n", millis());
+      stopAnimation();
+      return;
+    }
+    animation_loaded += n;
+    if (animation_loaded < IMAGE_FILE_SIZE) {
+      return;
+    }
+    animation_file.close();
+  }
+
+  unsigned long now = micros();
+  long late = (long)(now - animation_due_us);
+  if (late < 0) {
+    return;
+  }
+
+  swapImageBuffers();
+  scheduler.schedule(TASK_MATRIX, 0);  // Refresh immediately.
+
+  unsigned long duration_us = getFrameDuration(frame) * 1000;
+  animation_frames_shown++;
+  animation_jitter_sum_us += late;
+  animation_jitter_max_us = max(animation_jitter_max_us, (unsigned long)late);
+  if ((unsigned long)late >= duration_us) {
+    // Fell more than a whole frame behind, so restart the schedule from now
+    // rather than rushing through the backlog.
+    animation_frames_dropped++;
+    animation_due_us = now + duration_us;
+  } else {
+    animation_due_us += duration_us;
+  }
+
+  animation_index = (animation_index + 1) % frames.size();
+  animation_loaded = 0;
+}
+
+// *** Live streaming ***
+
+// Live frames arrive over UDP in the Distributed Display Protocol, as sent by
+// xLights, WLED and LedFx. Each packet has a header of flags, a sequence
+// number, a data type, a destination id, and the byte offset and length of
+// its RGB data within the frame. Since that data has the same layout as an
+// Image, it is read straight into image_back, and the frame is shown as soon
+// as a packet with the push flag arrives. Streamed frames are never saved.
+#define DDP_PORT (4048)
+#define DDP_HEADER_SIZE (10)
+#define DDP_TIMECODE_SIZE (4)
+#define DDP_FLAGS_VERSION_MASK (0xc0)
+#define DDP_FLAGS_VERSION_1 (0x40)
+#define DDP_FLAGS_TIMECODE (0x10)
+#define DDP_FLAGS_REPLY (0x04)
+#define DDP_FLAGS_QUERY (0x02)
+#define DDP_FLAGS_PUSH (0x01)
+#define DDP_SEQUENCE_MASK (0x0f)
+#define DDP_SEQUENCE_COUNT (15)
+// A packet further ahead in the sequence than this is taken to be one that
+// arrived late, rather than the end of a burst of losses.
+#define DDP_SEQUENCE_MAX_GAP (7)
+#define DDP_ID_DISPLAY (1)
+// The stream gives up image_back after this long without a packet.
+#define DDP_TIMEOUT_MS (2000)
+// Packets read per pass of the WiFi task, so a frame of about ten packets is
+// usually assembled at once while HTTP still gets a turn.
+#define DDP_PACKETS_PER_POLL (16)
+
+WiFiUDP stream_udp;
+unsigned long stream_last_ms = 0;
+uint8_t stream_sequence = 0;
+bool stream_frame_started = false;
+unsigned long stream_frame_begin_us = 0;
+int stream_dirty_begin = IMAGE_HEIGHT;
+int stream_dirty_end = 0;
+
+// Assembly time runs from the first packet of a frame until it is swapped in.
+// Lost packets are counted from gaps in the sequence numbers, and repeated
+// ones are dropped as duplicates.
+unsigned long stream_packets = 0;
+unsigned long stream_packets_lost = 0;
+unsigned long stream_packets_duplicate = 0;
+unsigned long stream_packets_rejected = 0;
+unsigned long stream_frames = 0;
+uint64_t stream_assembly_sum_us = 0;
+unsigned long stream_assembly_max_us = 0;
+
+static bool isStreamingRgb(uint8_t type) {
+  // Unset, RGB in the original spec, or RGB with 8 bit elements.
+  return type == 0x00 || type == 0x01 || type == 0x0b;
+}
+
+static void startStream() {
+  Serial.printf("%lu: stream from ", millis());
+  stream_udp.remoteIP().printTo(Serial);
+  Serial.printf("\n");
+
+  // A stream replaces any animation, and each frame starts from the one on
+  // screen so senders may update only part of the image.
+  image_back_owner = &stream_udp;
+  stopAnimation();
+  // A save pending from an upload would write a streamed frame instead.
+  scheduler.cancel(TASK_SAVE_IMAGE);
+  memcpy(image_back, image_bin, sizeof(Image));
+  stream_sequence = 0;
+  stream_frame_started = false;
+}
+
+static void presentStream() {
+  if (stream_dirty_begin < stream_dirty_end) {
+    swapImageBuffers(stream_dirty_begin, stream_dirty_end);
+    scheduler.schedule(TASK_MATRIX, 0);  // Refresh immediately.
+
+    // Only the rows in this frame differ between the buffers.
+    const size_t row_size = sizeof((*image_bin)[0]);
+    memcpy((*image_back)[stream_dirty_begin], (*image_bin)[stream_dirty_begin],
+           (stream_dirty_end - stream_dirty_begin) * row_size);
+  }
+
+  // Keep the display on for as long as the stream lasts.
+  setImageShowing(true);
+  scheduler.schedule(TASK_DAY_NIGHT, 30000);
+
+  unsigned long elapsed = micros() - stream_frame_begin_us;
+  stream_frames++;
+  stream_assembly_sum_us += elapsed;
+  stream_assembly_max_us = max(stream_assembly_max_us, elapsed);
+  stream_frame_started = false;
+}
+
+// Returns whether there was a packet.
+static bool readStreamPacket() {
+  int size = stream_udp.parsePacket();
+  if (size <= 0) {
+    return false;
+  }
+  unsigned long now_us = micros();
+  stream_packets++;
+
+  uint8_t header[DDP_HEADER_SIZE + DDP_TIMECODE_SIZE];
+  size_t header_size = DDP_HEADER_SIZE;
+  if (size < DDP_HEADER_SIZE ||
+      stream_udp.read(header, DDP_HEADER_SIZE) != DDP_HEADER_SIZE) {
+    stream_packets_rejected++;
+    return true;
+  }
+  uint8_t flags = header[0];
+  if (flags & DDP_FLAGS_TIMECODE) {
+    header_size += DDP_TIMECODE_SIZE;
+    if (size < (int)header_size ||
+        stream_udp.read(header + DDP_HEADER_SIZE, DDP_TIMECODE_SIZE) !=
+            DDP_TIMECODE_SIZE) {
+      stream_packets_rejected++;
+      return true;
+    }
+  }
+  uint8_t sequence = header[1] & DDP_SEQUENCE_MASK;
+  uint32_t offset = (uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 |
+                    (uint32_t)header[6] << 8 | header[7];
+  size_t length = (size_t)header[8] << 8 | header[9];
+
+  // Queries and status ids are not answered, and an upload holding the back
+  // buffer wins over a stream.
+  if ((flags & DDP_FLAGS_VERSION_MASK) != DDP_FLAGS_VERSION_1 ||
+      (flags & (DDP_FLAGS_REPLY | DDP_FLAGS_QUERY)) ||
+      header[3] != DDP_ID_DISPLAY || !isStreamingRgb(header[2]) ||
+      (size_t)size != header_size + length || offset > sizeof(Image) ||
+      length > sizeof(Image) - offset ||
+      (image_back_owner && image_back_owner != &stream_udp)) {
+    stream_packets_rejected++;
+    return true;
+  }
+  if (image_back_owner != &stream_udp) {
+    startStream();
+  }
+  stream_last_ms = millis();
+
+  // Sequence numbers count from 1 to 15, and are unused when 0. A packet
+  // behind the last one was counted lost when it was skipped, so it is taken
+  // back off, and its data is still used since it may belong to this frame.
+  if (sequence && stream_sequence) {
+    int ahead = (sequence - stream_sequence + DDP_SEQUENCE_COUNT) %
+                DDP_SEQUENCE_COUNT;
+    if (ahead == 0) {
+      stream_packets_duplicate++;
+      return true;
+    } else if (ahead <= DDP_SEQUENCE_MAX_GAP) {
+      stream_packets_lost += ahead - 1;
+      stream_sequence = sequence;
+    } else if (stream_packets_lost > 0) {
+      stream_packets_lost--;
+    }
+  } else {
+    stream_sequence = sequence;
+  }
+
+  if (!stream_frame_started) {
+    stream_frame_started = true;
+    stream_frame_begin_us = now_us;
+    stream_dirty_begin = IMAGE_HEIGHT;
+    stream_dirty_end = 0;
+  }
+  if (length) {
+    // After a short read the range is put back as it is on screen, and the
+    // packet is dropped.
+    const size_t row_size = sizeof((*image_back)[0]);
+    uint8_t* data = &(*image_back)[0][0][0] + offset;
+    if (stream_udp.read(data, length) != (int)length) {
+      memcpy(data, &(*image_bin)[0][0][0] + offset, length);
+      stream_packets_rejected++;
+      return true;
+    }
+    stream_dirty_begin = min(stream_dirty_begin, (int)(offset / row_size));
+    stream_dirty_end = max(stream_dirty_end,
+                           (int)((offset + length + row_size - 1) / row_size));
+  }
+
+  if (flags & DDP_FLAGS_PUSH) {
+    presentStream();
+  }
+  return true;
+}
+
+// Returns whether a stream is in progress.
+static bool loopStream() {
+  for (int i = 0; i < DDP_PACKETS_PER_POLL && readStreamPacket(); i++) {
+  }
+
+  if (image_back_owner == &stream_udp &&
+      millis() - stream_last_ms > DDP_TIMEOUT_MS) {
+    // The last frame stays on screen, but any animation takes over again.
+    Serial.printf("%lu: stream ended\n", millis());
+    image_back_owner = NULL;
+    startAnimation();
+  }
+  return image_back_owner == &stream_udp;
+}
+
 // *** WiFi and HTTP server ***
 
 WiFiClass wifi;
 WiFiUDP udp;
 MDNS mdns(udp);
 WiFiServer http_server(80);
-String http_auth;
 
-static int getHoursMinutes() {
-  // TODO: Would be *really* nice to have automatic dawn and dusk values.
+// The clock is corrected from the ESP32's network time this often.
+#define CLOCK_SYNC_MS (3600000)
 
+static void syncClock() {
   unsigned long seconds = wifi.getTime();
   if (seconds > 0) {
-    time_t t = seconds;
-    tm td = {0};
-    if (gmtime_r(&t, &td)) {
-      return td.tm_hour * 100 + td.tm_min;
+    wall_clock.sync(seconds, millis());
+  } else {
+    // The ESP32 has not reached an NTP server yet.
+    scheduler.schedule(TASK_CLOCK, 10000);
+  }
+}
+
+#define HTTP_AUTH_TOKENS (4)
+#define HTTP_AUTH_TOKEN_SIZE (128)
+
+// Authorization header values that are accepted, rebuilt when config.json
+// changes. Unused bytes are zero so every token compares the same way.
+char http_auth_tokens[HTTP_AUTH_TOKENS][HTTP_AUTH_TOKEN_SIZE];
+int http_auth_token_count = 0;
+
+static void addHttpAuthToken(FixedBuffer<HTTP_AUTH_TOKEN_SIZE>& token) {
+  if (http_auth_token_count >= HTTP_AUTH_TOKENS) {
+    Serial.printf("http: ignoring credentials beyond %d\n", HTTP_AUTH_TOKENS);
+  } else if (token.getWriteError() || token.size() >= HTTP_AUTH_TOKEN_SIZE) {
+    Serial.printf("http: ignoring credentials longer than %d\n",
+                  HTTP_AUTH_TOKEN_SIZE - 1);
+  } else {
+    memcpy(http_auth_tokens[http_auth_token_count++], token.begin(),
+           token.size());
+  }
+}
+
+static void addHttpAuthBasic(const char* user, const char* pass) {
+  if (!user || !pass) {
+    return;
+  }
+  FixedBuffer<HTTP_AUTH_TOKEN_SIZE> token;
+  token.print("Basic ");
+  {
+    Base64Encoder encoder(token);
+    encoder.print(user);
+    encoder.print(':');
+    encoder.print(pass);
+  }
+  addHttpAuthToken(token);
+}
+
+static void updateHttpAuth() {
+  bzero(http_auth_tokens, sizeof(http_auth_tokens));
+  http_auth_token_count = 0;
+
+  JsonVariantConst http = config_json["http"];
+  addHttpAuthBasic(http["user"], http["pass"]);
+  for (JsonVariantConst user : http["users"].as<JsonArrayConst>()) {
+    addHttpAuthBasic(user["user"], user["pass"]);
+  }
+
+  const char* bearer = http["token"];
+  if (bearer) {
+    FixedBuffer<HTTP_AUTH_TOKEN_SIZE> token;
+    token.print("Bearer ");
+    token.print(bearer);
+    addHttpAuthToken(token);
+  }
+
+  if (http_auth_token_count == 0) {
+    Serial.printf("http: no credentials in config.json\n");
+  }
+}
+
+// Checks every byte of every token whatever the input, so the time taken
+// doesn't reveal how much of a guess was right.
+static bool checkHttpAuth(const char* auth) {
+  size_t len = strnlen(auth, HTTP_AUTH_TOKEN_SIZE);
+  bool match = false;
+  for (int i = 0; i < http_auth_token_count; i++) {
+    uint8_t diff = len >= HTTP_AUTH_TOKEN_SIZE;
+    for (size_t j = 0; j < HTTP_AUTH_TOKEN_SIZE; j++) {
+      uint8_t x = j < len ? auth[j] : '\0';
+      diff |= x ^ http_auth_tokens[i][j];
     }
+    match |= diff == 0;
   }
-  return -1;
+  return match;
 }
 
+// Persistent connections are closed after this long without a new request.
+#define HTTP_KEEP_ALIVE_MS (5000)
+
+// The connection buffer only needs to hold request headers, small request
+// bodies, and reply headers, since larger reply bodies are written from where
+// they already live.
+#define HTTP_BUFFER_SIZE (2048)
+
+// Connections borrow a buffer from a shared pool when a request starts
+// arriving, and return it once they are waiting between requests, so
+// persistent connections only cost a buffer while they are in use.
+#define HTTP_BUFFERS (2)
+
+typedef FixedBuffer<HTTP_BUFFER_SIZE> HttpBuffer;
+
+HttpBuffer http_buffers[HTTP_BUFFERS];
+static bool http_buffer_used[HTTP_BUFFERS];
+
+// Returns NULL if every buffer is in use.
+static HttpBuffer* acquireHttpBuffer() {
+  for (size_t i = 0; i < HTTP_BUFFERS; i++) {
+    if (!http_buffer_used[i]) {
+      http_buffer_used[i] = true;
+      http_buffers[i].clear();
+      return &http_buffers[i];
+    }
+  }
+  return NULL;
+}
+
+static void releaseHttpBuffer(HttpBuffer* buffer) {
+  http_buffer_used[buffer - http_buffers] = false;
+}
+
+// Replies are written in chunks that grow while the socket accepts them whole
+// and shrink when it pushes back, since WiFiNINA does not implement
+// availableForWrite. Each run() keeps writing until the budget is spent.
+#define HTTP_WRITE_CHUNK_MIN (256)
+#define HTTP_WRITE_CHUNK_INITIAL (1024)
+#define HTTP_WRITE_CHUNK_MAX (2048)
+#define HTTP_WRITE_BUDGET_US (10000)
+
+// Adds the statistics of each connection slot, for /api/stats.
+static void getHttpStats(JsonArray dst);
+
+// Route handlers are called through a table of member pointers, in the order
+// that build-site.py lists them in SITE_HANDLERS.
+#define HTTP_HANDLER_METHOD(name) &HttpServerConnection::handle##name,
+
 class HttpServerConnection {
  public:
   enum State {
@@ -205,11 +1167,14 @@ class HttpServerConnection {
     STATE_CLOSE,
   } state;
 
+  typedef State (HttpServerConnection::*Handler)();
+
   WiFiClient sock;
   unsigned long connection_begin_ms;
   unsigned long connection_change_ms;
 
-  FixedBuffer<20480> data;
+  // Borrowed from http_buffers while a request is in progress.
+  HttpBuffer* data = NULL;
 
   const char* method;
   const char* resource;
@@ -217,60 +1182,134 @@ class HttpServerConnection {
   const char* authorization;
   const char* content_type;
   unsigned long content_length;
-
+  const char* accept_encoding;
+  const char* if_none_match;
+
+  // Whether the client asked for a persistent connection, and whether the
+  // whole request has been read so the next one can follow on the socket.
+  bool keep_alive;
+  bool request_consumed;
+
+  // Destination for bodies that are streamed straight to their final buffer
+  // instead of being collected in data. RGB888 bodies are copied as-is, and
+  // other formats pass through body_decoder. Image patches instead pass
+  // through body_rects, which writes into a copy of image_bin in image_back.
+  uint8_t* body_dst;
+  size_t body_pos;
+  ImageDecoder::Format body_format;
+  ImageDecoder body_decoder;
+  bool body_patch;
+  RectDecoder<IMAGE_WIDTH> body_rects;
+
+  // Called once a POST body has been read, as chosen by the route handler.
+  Handler body_handler;
+
+  // Replies are written after any pipelined request data, which starts at
+  // data->begin() and stays in the buffer for the next request. The reply body
+  // either follows the headers in data, or is written without a copy from
+  // reply_body, or is the current image expanded to RGBA a row at a time.
   const uint8_t* reply_data;
   size_t reply_pos;
   size_t reply_len;
+  const uint8_t* reply_body;
+  size_t reply_body_len;
+  bool reply_body_image;
+  size_t reply_offset;
+  bool reply_keep_alive;
+  bool reply_failed;
+
+  // Offset from data->begin() where the search for the end of the current
+  // line resumes, so bytes are only scanned once however they arrive.
+  size_t line_scan;
+
+  // Set when pipelined data is waiting to be parsed without a socket read.
+  bool rescan;
+
+  // Requests already answered on this connection.
+  unsigned long requests;
+
+  // The adapted write size, and when the current reply started writing.
+  size_t tx_chunk;
+  unsigned long tx_reply_begin_us;
+
+  // Transmit statistics, kept across connections using this slot. Writes
+  // are short when the socket accepts part of a chunk, and stalled when it
+  // accepts none.
+  unsigned long tx_replies;
+  uint64_t tx_bytes;
+  uint64_t tx_us;
+  unsigned long tx_short_writes;
+  unsigned long tx_stalls;
 
   void clear() {
-    state = STATE_READING_REQUEST;
     sock.stop();
     connection_begin_ms = 0;
     connection_change_ms = 0;
-    data.clear();
-    method = NULL;
-    resource = NULL;
-    version = NULL;
-    authorization = NULL;
-    content_type = NULL;
-    content_length = 0;
-    reply_data = NULL;
-    reply_pos = 0;
-    reply_len = 0;
+    releaseBuffer();
+    clearRequest();
+    requests = 0;
   }
 
   void begin(WiFiClient sock) {
     clear();
     this->sock = sock;
+    tx_chunk = HTTP_WRITE_CHUNK_INITIAL;
     unsigned long now = millis();
     connection_begin_ms = now;
     connection_change_ms = now;
   }
 
+  // Returns whether the connection is being kept open between requests, and
+  // could be closed to make room for another client.
+  bool isIdle() const {
+    return requests > 0 && state == STATE_READING_REQUEST && !buffered() &&
+           !rescan;
+  }
+
+  size_t buffered() const { return data ? data->size() : 0; }
+
   void run() {
     // Check timeouts.
     unsigned long now = millis();
     if (sock) {
-      if (now - connection_begin_ms > 15000) {
-        Serial.printf("http connection timeout (body=%ld)\n", data.size());
+      if (isIdle() && now - connection_change_ms > HTTP_KEEP_ALIVE_MS) {
+        state = STATE_CLOSE;
+      } else if (isIdle()) {
+        // Waiting for the next request on a persistent connection.
+      } else if (now - connection_begin_ms > 15000) {
+        Serial.printf("http connection timeout (body=%u)\n",
+                      (unsigned)buffered());
         state = STATE_CLOSE;
       } else if (now - connection_change_ms > 1000) {
-        Serial.printf("http connection idle timeout (body=%ld)\n", data.size());
+        Serial.printf("http connection idle timeout (body=%u)\n",
+                      (unsigned)buffered());
         state = STATE_CLOSE;
       }
     }
 
     if (state == STATE_READING_REQUEST || state == STATE_READING_HEADERS) {
-      int n = sock.available() ? sock.read(data.end(), data.remaining()) : 0;
-      if (n <= 0) {
+      HotPathProfiler::Scope profile(profiler, PROFILE_HTTP_READ);
+      int avail = sock.available();
+      if (avail > 0 && !data && !(data = acquireHttpBuffer())) {
+        // Wait for another connection to return a buffer, without counting
+        // the wait against this one.
+        connection_change_ms = now;
         return;
       }
-      data.advanceEnd(n);
-
-      connection_change_ms = now;
+      int n = avail > 0 ? sock.read(data->end(), data->remaining()) : 0;
+      if (n > 0) {
+        if (isIdle()) {
+          // The request timeout starts with its first byte.
+          connection_begin_ms = now;
+        }
+        data->advanceEnd(n);
+        connection_change_ms = now;
+      } else if (!rescan) {
+        return;
+      }
+      rescan = false;
 
-      // Scan the data for newlines, starting at the beginning of the latest
-      // line.
+      // Consume complete lines, continuing the scan of any partial line.
       while (state == STATE_READING_REQUEST || state == STATE_READING_HEADERS) {
         char* line = consumeLine();
         if (!line) {
@@ -279,7 +1318,11 @@ class HttpServerConnection {
         }
         // DEBUG: Serial.printf("line: %s\n", line);
 
-        if (line[0] == '\0') {
+        if (line[0] == '\0' && state == STATE_READING_REQUEST) {
+          // Empty lines before the request line are ignored, since some
+          // clients send an extra CRLF after a body.
+          continue;
+        } else if (line[0] == '\0') {
           // Found a blank line, process the end of headers.
           state = processHeadersDone();
           break;
@@ -292,55 +1335,203 @@ class HttpServerConnection {
           state = processHeaderLine(line);
         }
       }
+
+      if ((state == STATE_READING_REQUEST || state == STATE_READING_HEADERS) &&
+          !data->remaining()) {
+        // The headers do not fit, so drop them to make room for the reply.
+        data->truncate(0);
+        data->compact();
+        state = sendReplyStatus(431, "Request Header Fields Too Large", "");
+      }
+    } else if (state == STATE_READING_BODY && body_dst) {
+      HotPathProfiler::Scope profile(profiler, PROFILE_HTTP_BODY);
+      // Anything that arrived along with the headers is consumed first, then
+      // the rest is read from the socket. RGB888 bodies are already in the
+      // in-memory format and are read directly into the destination, while
+      // other formats are decoded a chunk at a time.
+      size_t n = min(data->size(), content_length - body_pos);
+      bool ok = writeBody(data->begin(), n);
+      data->advanceBegin(n);
+
+      int avail = sock.available();
+      if (ok && avail > 0 && body_pos < content_length) {
+        size_t want = min((size_t)avail, content_length - body_pos);
+        int r;
+        if (body_format == ImageDecoder::FORMAT_RGB888 && !body_patch) {
+          r = sock.read(body_dst + body_pos, want);
+          if (r > 0) {
+            body_pos += r;
+          }
+        } else {
+          uint8_t chunk[512];
+          r = sock.read(chunk, min(want, sizeof(chunk)));
+          if (r > 0) {
+            ok = writeBody(chunk, r);
+          }
+        }
+        if (r > 0) {
+          connection_change_ms = now;
+        }
+      }
+
+      if (!ok) {
+        releaseBody();
+        state = sendReplyStatus(400, "Bad Request", "");
+      } else if (body_pos >= content_length) {
+        state = processBodyDone();
+      }
     } else if (state == STATE_READING_BODY) {
+      HotPathProfiler::Scope profile(profiler, PROFILE_HTTP_BODY);
       int avail = sock.available();
-      int n = avail > 0
-                  ? sock.read(data.end(), min((size_t)avail, data.remaining()))
-                  : 0;
+      int n = avail > 0 ? sock.read(data->end(),
+                                    min((size_t)avail, data->remaining()))
+                        : 0;
       if (n > 0) {
-        data.advanceEnd(n);
+        data->advanceEnd(n);
         connection_change_ms = now;
       }
 
-      if (data.size() >= content_length || !data.remaining()) {
+      if (data->size() >= content_length || !data->remaining()) {
         state = processBodyDone();
       }
     } else if (state == STATE_WRITING_REPLY) {
-      // TODO: Would be nice to check sock.availableForWrite, but that seems to
-      // be unimplemented. For the moment, throttling our write to 1K buffers
-      // seems to avoid problems.
-      size_t n =
-          sock.write(reply_data + reply_pos, min(1024u, reply_len - reply_pos));
-      if (n > 0) {
-        connection_change_ms = now;
-        reply_pos += n;
+      HotPathProfiler::Scope profile(profiler, PROFILE_HTTP_WRITE);
+      unsigned long begin_us = micros();
+      if (reply_pos == 0) {
+        tx_reply_begin_us = begin_us;
+      }
+
+      bool done = reply_pos >= reply_len + reply_body_len;
+      while (!done) {
+        size_t want = 0;
+        size_t n = writeReplyChunk(tx_chunk, &want);
+        if (n > 0) {
+          connection_change_ms = now;
+          reply_pos += n;
+        }
+        done = reply_pos >= reply_len + reply_body_len;
+
+        if (n == 0) {
+          tx_stalls++;
+          tx_chunk = max(tx_chunk / 2, (size_t)HTTP_WRITE_CHUNK_MIN);
+          break;
+        } else if (n < want) {
+          tx_short_writes++;
+          tx_chunk = max(n, (size_t)HTTP_WRITE_CHUNK_MIN);
+          break;
+        } else if (want == tx_chunk) {
+          tx_chunk = min(tx_chunk * 2, (size_t)HTTP_WRITE_CHUNK_MAX);
+        }
+
+        if (micros() - begin_us >= HTTP_WRITE_BUDGET_US) {
+          break;
+        }
       }
 
-      if (reply_pos >= reply_len || !sock.connected()) {
+      if (done) {
+        tx_replies++;
+        tx_bytes += reply_len + reply_body_len;
+        tx_us += micros() - tx_reply_begin_us;
+      }
+
+      if (done && reply_keep_alive && sock.connected()) {
+        nextRequest();
+      } else if (done || !sock.connected()) {
         state = STATE_CLOSE;
       }
     } else if (state == STATE_CLOSE) {
+      releaseBody();
+      releaseBuffer();
       sock.stop();
     }
   }
 
  private:
+  void clearRequest() {
+    state = STATE_READING_REQUEST;
+    method = NULL;
+    resource = NULL;
+    version = NULL;
+    authorization = NULL;
+    content_type = NULL;
+    content_length = 0;
+    accept_encoding = NULL;
+    if_none_match = NULL;
+    keep_alive = false;
+    request_consumed = false;
+    releaseBody();
+    body_handler = NULL;
+    reply_data = NULL;
+    reply_pos = 0;
+    reply_len = 0;
+    reply_body = NULL;
+    reply_body_len = 0;
+    reply_body_image = false;
+    reply_offset = 0;
+    reply_keep_alive = false;
+    reply_failed = false;
+    line_scan = 0;
+    rescan = false;
+  }
+
+  // Resets the parser for the next request on a persistent connection,
+  // keeping any pipelined data that has already arrived.
+  void nextRequest() {
+    data->truncate(reply_offset);
+    data->compact();
+    clearRequest();
+    rescan = data->size() > 0;
+    if (!rescan) {
+      releaseBuffer();
+    }
+    requests++;
+
+    unsigned long now = millis();
+    connection_begin_ms = now;
+    connection_change_ms = now;
+  }
+
+  // Returns the next line with its CRLF or LF replaced by NUL, or NULL if it
+  // is incomplete. A header line is only complete once the next line has
+  // started, because one starting with whitespace is folded into it.
   char* consumeLine() {
-    char* saved = reinterpret_cast<char*>(data.begin());
-    for (size_t i = 0; i < data.size(); i++) {
-      char a = data.get(i + 0);
-      char b = data.get(i + 1);
-      if (a == '\r' && b == '\n') {
-        data.set(i, '\0');
-        data.advanceBegin(i + 2);
-        return saved;
-      } else if (a == '\r' || a == '\n') {
-        data.set(i, '\0');
-        data.advanceBegin(i + 1);
-        return saved;
+    char* line = reinterpret_cast<char*>(data->begin());
+    size_t size = data->size();
+    while (line_scan < size) {
+      char* lf = static_cast<char*>(
+          memchr(line + line_scan, '\n', size - line_scan));
+      if (!lf) {
+        line_scan = size;
+        return NULL;
+      }
+
+      size_t end = lf - line;
+      bool cr = end > 0 && line[end - 1] == '\r';
+      bool empty = end == (cr ? 1u : 0u);
+      if (state == STATE_READING_HEADERS && !empty) {
+        if (end + 1 >= size) {
+          // Resume at the same newline once the next byte arrives.
+          line_scan = end;
+          return NULL;
+        } else if (line[end + 1] == ' ' || line[end + 1] == '\t') {
+          line[end] = ' ';
+          if (cr) {
+            line[end - 1] = ' ';
+          }
+          line_scan = end + 1;
+          continue;
+        }
+      }
+
+      line[end] = '\0';
+      if (cr) {
+        line[end - 1] = '\0';
       }
+      data->advanceBegin(end + 1);
+      line_scan = 0;
+      return line;
     }
-    return nullptr;
+    return NULL;
   }
 
   State processRequestLine(char* line) {
@@ -359,9 +1550,18 @@ class HttpServerConnection {
     resource = p1 + 1;
     version = p2 + 1;
 
+    // Persistent connections are the default from HTTP/1.1.
+    keep_alive = strcmp(version, "HTTP/1.1") == 0;
+
     return STATE_READING_HEADERS;
   }
 
+  // Compares a header name, checking the length before any characters.
+  template <size_t N>
+  static bool isHeader(const char* name, size_t len, const char (&expect)[N]) {
+    return len == N - 1 && strncasecmp(name, expect, N - 1) == 0;
+  }
+
   State processHeaderLine(char* line) {
     char* p0 = line;
     char* p1 = strchr(p0, ':');
@@ -372,23 +1572,36 @@ class HttpServerConnection {
 
     // DEBUG: Serial.printf("header '%s' '%s'\n", p0, p1);
 
+    size_t len = p1 - p0;
     *p1 = '\0';
     p1++;
-    if (*p1 == ' ') {
-      p1++;
+
+    // Trim the optional whitespace around the value, which includes any
+    // folded line breaks.
+    p1 += strspn(p1, " \t");
+    char* p2 = p1 + strlen(p1);
+    while (p2 > p1 && (p2[-1] == ' ' || p2[-1] == '\t')) {
+      *--p2 = '\0';
     }
 
-    if (strcasecmp(p0, "Content-Type") == 0) {
+    if (isHeader(p0, len, "Content-Type")) {
       content_type = p1;
-    } else if (strcasecmp(p0, "Content-Length") == 0) {
-      // Parse error is indicated by ULONG_MAX.
-      unsigned long length = strtoul(p1, NULL, 10);
-      if (length > data.remaining()) {
-        return sendReplyStatus(413, "Content Too Large", "");
-      }
-      content_length = length;
-    } else if (strcasecmp(p0, "Authorization") == 0) {
+    } else if (isHeader(p0, len, "Content-Length")) {
+      // Parse error is indicated by ULONG_MAX, and is rejected as too large
+      // once the headers are done.
+      content_length = strtoul(p1, NULL, 10);
+    } else if (isHeader(p0, len, "Authorization")) {
       authorization = p1;
+    } else if (isHeader(p0, len, "Accept-Encoding")) {
+      accept_encoding = p1;
+    } else if (isHeader(p0, len, "If-None-Match")) {
+      if_none_match = p1;
+    } else if (isHeader(p0, len, "Connection")) {
+      if (hasToken(p1, "close")) {
+        keep_alive = false;
+      } else if (hasToken(p1, "keep-alive")) {
+        keep_alive = true;
+      }
     }
 
     return STATE_READING_HEADERS;
@@ -398,170 +1611,529 @@ class HttpServerConnection {
     // DEBUG: Serial.printf("HTTP request %s %s %s\n", method, resource,
     // version);
 
+    // Requests without a body are complete once the headers are done.
+    request_consumed = method && resource && version && !content_length;
+
     if (!method || !resource || !version) {
       return sendReplyStatus(400, "Bad Request", "");
-    } else if (!authorization || !checkAuthorization(authorization)) {
+    } else if (!authorization || !checkHttpAuth(authorization)) {
       return sendReplyStatus(
           401, "Unauthorized",
           "WWW-Authenticate: Basic realm=\"billboard\", charset=\"UTF-8\"\r\n");
-    } else if (strcmp(method, "GET") == 0) {
-      if (strcmp(resource, "/api/image") == 0) {
-        return sendReplyData(200, "OK", "application/octet-stream",
-                             sizeof(image_bin), NULL, image_bin);
-      } else if (strcmp(resource, "/api/gain") == 0) {
-        JsonDocument message;
-        message["value"] = getRequestedGain();
-        return sendReplyJson(200, "OK", message);
-      } else if (strcmp(resource, "/api/rotation") == 0) {
-        JsonDocument message;
-        message["rotation"] = getRotation();
-        return sendReplyJson(200, "OK", message);
-      } else if (strcmp(resource, "/api/time") == 0) {
-        JsonDocument message;
-        message["morning"] = getMorning();
-        message["evening"] = getEvening();
-        return sendReplyJson(200, "OK", message);
-      } else if (strcmp(resource, "/api/now") == 0) {
-        JsonDocument message;
-        message["value"] = getHoursMinutes();
-        return sendReplyJson(200, "OK", message);
-      }
-
-      const site_entry* file = findSiteFile(resource);
-      if (!file) {
-        // Try "${resource}/index.html"
-        String index(resource);
-        if (!index.endsWith("/")) {
-          index += "/";
-        }
-        index += "index.html";
-        file = findSiteFile(index.c_str());
-      }
-      if (!file) {
-        file = findSiteFile("/index.html");
-      }
-      if (!file) {
-        file = findSiteFile("/404.html");
+    }
+
+    const site_route* route = findRoute(resource);
+    if (strcmp(method, "GET") == 0) {
+      if (route && route->get >= 0) {
+        return dispatch(route->get);
       }
 
+      const site_entry* file = route && route->file ? route->file
+                                                    : site_fallback;
       if (file) {
-        return sendReplyData(200, "OK", file->type, file->length,
-                             file->encoding, site_data + file->offset);
+        return sendReplyFile(file);
       } else {
         return sendReplyStatus(404, "Not Found", "");
       }
-    } else if (strcmp(method, "POST") == 0 &&
-               (strcmp(resource, "/api/image") == 0 ||
-                strcmp(resource, "/api/gain") == 0 ||
-                strcmp(resource, "/api/rotation") == 0 ||
-                strcmp(resource, "/api/time") == 0)) {
-      return STATE_READING_BODY;
+    } else if (strcmp(method, "POST") == 0 && route && route->post >= 0) {
+      return dispatch(route->post);
+    } else if (strcmp(method, "PATCH") == 0 && route && route->patch >= 0) {
+      return dispatch(route->patch);
     } else {
       return sendReplyStatus(405, "Method Not Allowed", "");
     }
   }
 
   State processBodyDone() {
-    const unsigned long now = millis();
+    request_consumed = body_dst ? body_pos >= content_length
+                                : data->size() >= content_length;
 
-    if (!method || !resource || !version) {
-      return sendReplyStatus(400, "Bad Request", "");
+    if (!body_handler) {
+      // Should have rejected this at the end of the headers.
+      return sendReplyStatus(500, "Internal Server Error", "");
+    }
+    return (this->*body_handler)();
+  }
+
+  // Calls a route handler by the id that build-site.py assigned to it.
+  State dispatch(int id) {
+    static const Handler handlers[] = {SITE_HANDLERS(HTTP_HANDLER_METHOD)};
+    return (this->*handlers[id])();
+  }
+
+  const site_route* findRoute(const char* name) {
+    const site_route* route =
+        &site_routes[site_route_hash(name) & (SITE_ROUTES_SIZE - 1)];
+    return route->name && strcmp(route->name, name) == 0 ? route : NULL;
+  }
+
+  // *** Route handlers ***
+
+  State handleGetImage() { return sendReplyImage(); }
+
+  State handleGetGain() {
+    JsonDocument message(&temp_json_arena);
+    message["value"] = settings.gain;
+    message["gamma"] = settings.gamma;
+    for (int i = 0; i < 3; i++) {
+      message["balance"][i] = settings.balance[i];
+    }
+    return sendReplyJson(200, "OK", message);
+  }
+
+  State handleGetRotation() {
+    JsonDocument message(&temp_json_arena);
+    message["rotation"] = settings.rotation;
+    return sendReplyJson(200, "OK", message);
+  }
+
+  static void setScheduleTimeJson(JsonVariant dst, const ScheduleTime& time) {
+    if (time.kind == SCHEDULE_SUNRISE) {
+      dst = "sunrise";
+    } else if (time.kind == SCHEDULE_SUNSET) {
+      dst = "sunset";
+    } else {
+      dst = time.hm;
+    }
+  }
+
+  State handleGetTime() {
+    JsonDocument message(&temp_json_arena);
+    setScheduleTimeJson(message["morning"], settings.morning);
+    setScheduleTimeJson(message["evening"], settings.evening);
+    if (!frames_json["timezone"].isNull()) {
+      message["timezone"] = frames_json["timezone"];
     }
+    if (settings.has_location) {
+      message["latitude"] = settings.latitude;
+      message["longitude"] = settings.longitude;
+    }
+    int sunrise = getSunHoursMinutes(true);
+    int sunset = getSunHoursMinutes(false);
+    if (sunrise >= 0 && sunset >= 0) {
+      message["sunrise"] = sunrise;
+      message["sunset"] = sunset;
+    }
+    return sendReplyJson(200, "OK", message);
+  }
+
+  State handleGetNow() {
+    JsonDocument message(&temp_json_arena);
+    message["value"] = getHoursMinutes();
+    message["drift_ppm"] = wall_clock.driftPpm();
+    return sendReplyJson(200, "OK", message);
+  }
+
+  State handleGetStats() {
+    JsonDocument message(&temp_json_arena);
+    message["frames_drawn"] = render_frames_drawn;
+    message["frames_skipped"] = render_frames_skipped;
+    message["present_avg_us"] =
+        render_frames_drawn ? render_present_sum_us / render_frames_drawn : 0;
+    message["present_max_us"] = render_present_max_us;
+    JsonObject animation = message["animation"].to<JsonObject>();
+    animation["frames_shown"] = animation_frames_shown;
+    animation["frames_dropped"] = animation_frames_dropped;
+    animation["jitter_avg_us"] = animation_frames_shown
+                                     ? animation_jitter_sum_us /
+                                           animation_frames_shown
+                                     : 0;
+    animation["jitter_max_us"] = animation_jitter_max_us;
+    JsonObject stream = message["stream"].to<JsonObject>();
+    stream["packets"] = stream_packets;
+    stream["packets_lost"] = stream_packets_lost;
+    stream["packets_duplicate"] = stream_packets_duplicate;
+    stream["packets_rejected"] = stream_packets_rejected;
+    stream["frames"] = stream_frames;
+    stream["assembly_avg_us"] =
+        stream_frames ? stream_assembly_sum_us / stream_frames : 0;
+    stream["assembly_max_us"] = stream_assembly_max_us;
+    getHttpStats(message["http"].to<JsonArray>());
+    JsonObject memory = message["memory"].to<JsonObject>();
+    getArenaStats(memory["config"].to<JsonObject>(), config_json_arena);
+    getArenaStats(memory["frames"].to<JsonObject>(), frames_json_arena);
+    getArenaStats(memory["temp"].to<JsonObject>(), temp_json_arena);
+    HeapInfo heap_info = getHeapInfo();
+    JsonObject heap = memory["heap"].to<JsonObject>();
+    heap["size"] = heap_info.size;
+    heap["used"] = heap_info.used;
+    heap["free"] = heap_info.free;
+    JsonObject tasks = message["tasks"].to<JsonObject>();
+    for (size_t i = 0; i < scheduler.size(); i++) {
+      const auto& task = scheduler.task(i);
+      JsonObject stats = tasks[task.name].to<JsonObject>();
+      stats["runs"] = task.runs;
+      stats["missed"] = task.missed;
+      stats["worst_us"] = task.worst_us;
+    }
+    return sendReplyJson(200, "OK", message);
+  }
 
-    if (strcmp(method, "POST") == 0 && strcmp(resource, "/api/image") == 0) {
-      if (data.size() != sizeof(image_bin)) {
-        Serial.printf(
-            "http PUT image.bin failed (contentLength=%lu, body=%lu)\n",
-            content_length, data.size());
-        return sendReplyStatus(500, "Internal Server Error", "");
+  State handleGetProfile() {
+    JsonDocument message(&temp_json_arena);
+    message["ticks_per_sec"] = HotPathProfiler::ticksPerSecond();
+    for (size_t i = 0; i < profiler.size(); i++) {
+      const HotPathProfiler::Entry& entry = profiler.entry(i);
+      JsonObject stats = message[profile_names[i]].to<JsonObject>();
+      stats["count"] = entry.count;
+      if (!entry.count) {
+        continue;
       }
+      stats["min"] = entry.min;
+      stats["avg"] = entry.sum / entry.count;
+      stats["max"] = entry.max;
+
+      // Only the buckets from the first to the last non-empty one are sent.
+      size_t first = 0;
+      size_t last = HotPathProfiler::kBuckets - 1;
+      while (!entry.histogram[first]) {
+        first++;
+      }
+      while (!entry.histogram[last]) {
+        last--;
+      }
+      stats["log2_first"] = first;
+      JsonArray histogram = stats["log2"].to<JsonArray>();
+      for (size_t b = first; b <= last; b++) {
+        histogram.add(entry.histogram[b]);
+      }
+    }
+    return sendReplyJson(200, "OK", message);
+  }
 
-      // DEBUG: Serial.printf("new upload at %lu\n", millis());
+  State handlePostImage() {
+    if (!ImageDecoder::parseFormat(content_type, &body_format)) {
+      return sendReplyStatus(415, "Unsupported Media Type", "");
+    } else if (!ImageDecoder::checkLength(body_format, content_length,
+                                          IMAGE_PIXELS)) {
+      return sendReplyStatus(400, "Bad Request", "");
+    } else if (image_back_owner) {
+      return sendReplyStatus(503, "Service Unavailable", "");
+    }
+    // Stream the upload into the back buffer, so the displayed image is
+    // never half-written.
+    image_back_owner = this;
+    interruptAnimation();
+    body_dst = &(*image_back)[0][0][0];
+    body_pos = 0;
+    body_decoder.begin(body_format, body_dst, &(*image_bin)[0][0][0],
+                       IMAGE_PIXELS);
+    body_handler = &HttpServerConnection::finishPostImage;
+    return STATE_READING_BODY;
+  }
 
-      memcpy(image_bin, data.begin(), sizeof(image_bin));
+  State finishPostImage() {
+    bool complete = body_format == ImageDecoder::FORMAT_RGB888
+                        ? body_pos == sizeof(Image)
+                        : body_decoder.done();
+    if (image_back_owner != this || !complete) {
+      Serial.printf("http PUT image.bin failed (contentLength=%lu, body=%lu)\n",
+                    content_length, body_pos);
+      releaseBody();
+      return sendReplyStatus(500, "Internal Server Error", "");
+    }
+
+    // DEBUG: Serial.printf("new upload at %lu\n", millis());
+
+    // An uploaded image replaces any animation until frames.json is
+    // reloaded.
+    stopAnimation();
+    swapImageBuffers();
+    releaseBody();
+
+    // Save the image if we make it through the next while without crashing.
+    scheduler.schedule(TASK_SAVE_IMAGE, 1000);
+
+    // Always display the newly-updated image for a while.
+    setImageShowing(true);
+    scheduler.schedule(TASK_DAY_NIGHT, 30000);
+    scheduler.schedule(TASK_MATRIX, 0);  // Refresh immediately.
+
+    return sendReplyStatus(200, "OK", "");
+  }
 
-      // Save the image if we make it through the next while without crashing.
-      image_saving = true;
-      image_saving_stamp = now;
+  // Rectangles are drawn over a copy of the displayed image a row at a time,
+  // for small frequent updates. Unlike a full upload, this does not wake the
+  // display at night.
+  State handlePatchImage() {
+    if (!ImageDecoder::parseFormat(content_type, &body_format)) {
+      return sendReplyStatus(415, "Unsupported Media Type", "");
+    } else if (!content_length) {
+      return sendReplyStatus(400, "Bad Request", "");
+    } else if (image_back_owner) {
+      return sendReplyStatus(503, "Service Unavailable", "");
+    }
+    // The animation only stops once the patch is applied, so a bad one
+    // leaves it running.
+    image_back_owner = this;
+    interruptAnimation();
+    memcpy(image_back, image_bin, sizeof(Image));
+    body_patch = true;
+    body_dst = &(*image_back)[0][0][0];
+    body_pos = 0;
+    body_rects.begin(body_format, IMAGE_WIDTH, IMAGE_HEIGHT);
+    body_handler = &HttpServerConnection::finishPatchImage;
+    return STATE_READING_BODY;
+  }
 
-      // Always display the newly-updated image for a while.
-      image_showing = true;
-      image_showing_stamp = now;
-      image_refresh_stamp = now - 60000u;  // Refresh immediately.
+  State finishPatchImage() {
+    if (image_back_owner != this || !body_rects.done()) {
+      releaseBody();
+      return sendReplyStatus(400, "Bad Request", "");
+    }
 
-      return sendReplyStatus(200, "OK", "");
+    // Only the patched rows differ from the image on screen. A patched image
+    // replaces any animation, as an upload does.
+    if (body_rects.dirtyBegin() < body_rects.dirtyEnd()) {
+      stopAnimation();
+      swapImageBuffers(body_rects.dirtyBegin(), body_rects.dirtyEnd());
+      scheduler.schedule(TASK_SAVE_IMAGE, 1000);
+      scheduler.schedule(TASK_MATRIX, 0);  // Refresh immediately.
     }
+    releaseBody();
+    return sendReplyStatus(200, "OK", "");
+  }
+
+  State handlePostGain() {
+    return readJsonBody(&HttpServerConnection::finishPostGain);
+  }
 
-    if (strcmp(method, "POST") == 0 &&
-        (strcmp(resource, "/api/gain") == 0 ||
-         strcmp(resource, "/api/rotation") == 0 ||
-         strcmp(resource, "/api/time") == 0)) {
-      bool is_gain = resource[5] == 'g';
-      bool is_rotation = resource[5] == 'r';
+  State handlePostRotation() {
+    return readJsonBody(&HttpServerConnection::finishPostRotation);
+  }
+
+  State handlePostTime() {
+    return readJsonBody(&HttpServerConnection::finishPostTime);
+  }
 
-      // Ensure the content is NUL-terminated for the JSON parser.
-      data.print('\0');
+  State finishPostGain() {
+    JsonDocument message(&temp_json_arena);
+    if (!parseJsonBody(message)) {
+      return sendReplyStatus(500, "Internal Server Error", "");
+    }
 
-      JsonDocument message;
-      auto err = deserializeJson(message, data.begin());
-      if (err) {
-        return sendReplyStatus(500, "Internal Server Error", "");
+    float value = constrain(message["value"].as<float>(), 0.0, 1.0);
+    frames_json["gain"] = value;
+    if (message["gamma"].is<float>()) {
+      frames_json["gamma"] = constrain(message["gamma"].as<float>(), 0.1, 4.0);
+    }
+    for (int i = 0; i < 3; i++) {
+      if (message["balance"][i].is<float>()) {
+        frames_json["balance"][i] =
+            constrain(message["balance"][i].as<float>(), 0.0, 1.0);
       }
+    }
+    matrix_lut_stale = true;
 
-      if (is_gain) {
-        float value = constrain(message["value"].as<float>(), 0.0, 1.0);
-        frames_json["gain"] = value;
-      } else if (is_rotation) {
-        frames_json["rotation"] = message["value"].as<int>();
-      } else {
-        if (message["morning"].is<int>()) {
-          frames_json["morning"] = message["morning"].as<int>();
-        }
-        if (message["evening"].is<int>()) {
-          frames_json["evening"] = message["evening"].as<int>();
-        }
+    return finishPostSettings(true);
+  }
+
+  State finishPostRotation() {
+    JsonDocument message(&temp_json_arena);
+    if (!parseJsonBody(message)) {
+      return sendReplyStatus(500, "Internal Server Error", "");
+    }
+
+    frames_json["rotation"] = message["value"].as<int>();
+
+    return finishPostSettings(true);
+  }
+
+  State finishPostTime() {
+    JsonDocument message(&temp_json_arena);
+    if (!parseJsonBody(message)) {
+      return sendReplyStatus(500, "Internal Server Error", "");
+    }
+
+    const char* timezone = message["timezone"];
+    if (timezone && !Timezone().parse(timezone)) {
+      return sendReplyStatus(400, "Bad Request", "");
+    }
+
+    for (const char* key : {"morning", "evening"}) {
+      JsonVariantConst value = message[key];
+      if (value.is<int>()) {
+        frames_json[key] = value.as<int>();
+      } else if (value == "sunrise" || value == "sunset") {
+        frames_json[key] = value.as<const char*>();
       }
+    }
+    if (timezone) {
+      frames_json["timezone"] = timezone;
+    }
+    if (message["latitude"].is<float>() && message["longitude"].is<float>()) {
+      frames_json["latitude"] =
+          constrain(message["latitude"].as<float>(), -90.0, 90.0);
+      frames_json["longitude"] =
+          constrain(message["longitude"].as<float>(), -180.0, 180.0);
+    }
+
+    return finishPostSettings(false);
+  }
 
-      frames_saving = true;
-      frames_saving_stamp = millis();
+  // Applies and saves frames_json after a settings change, and either redraws
+  // the image or re-applies the time of day schedule.
+  State finishPostSettings(bool redraw) {
+    loadFrameSettings();
+    scheduler.schedule(TASK_SAVE_FRAMES, 1000);
+
+    // Always display the newly-updated image for a while, unless the change
+    // is to the time of day schedule, which is applied immediately.
+    setImageShowing(true);
+    if (redraw) {
+      markAllDirty();
+      scheduler.schedule(TASK_DAY_NIGHT, 30000);
+      scheduler.schedule(TASK_MATRIX, 0);
+    } else {
+      scheduler.schedule(TASK_DAY_NIGHT, 0);
+    }
 
-      // Always display the newly-updated image for a while.
-      image_showing = true;
-      image_showing_stamp = now;
-      image_refresh_stamp = now;
+    return sendReplyStatus(200, "OK", "");
+  }
 
-      // Apply the changed setting immediately.
-      if (is_gain || is_rotation) {
-        image_refresh_stamp -= 60000;
-      } else {
-        image_showing_stamp -= 60000;
+  // Collects a small JSON body in data, then calls the handler.
+  State readJsonBody(Handler handler) {
+    if (content_length > data->remaining()) {
+      return sendReplyStatus(413, "Content Too Large", "");
+    }
+    body_handler = handler;
+    return STATE_READING_BODY;
+  }
+
+  bool parseJsonBody(JsonDocument& message) {
+    // Only the body is parsed, since pipelined requests may follow it.
+    size_t body_size = min(data->size(), (size_t)content_length);
+    HotPathProfiler::Scope profile(profiler, PROFILE_JSON_PARSE);
+    auto err = deserializeJson(
+        message, reinterpret_cast<const char*>(data->begin()), body_size);
+    data->advanceBegin(body_size);
+    return !err;
+  }
+
+  void releaseBuffer() {
+    if (data) {
+      releaseHttpBuffer(data);
+      data = NULL;
+    }
+  }
+
+  void releaseBody() {
+    if (image_back_owner == this) {
+      image_back_owner = NULL;
+    }
+    body_dst = NULL;
+    body_pos = 0;
+    body_patch = false;
+  }
+
+  bool writeBody(const uint8_t* src, size_t n) {
+    if (body_patch) {
+      if (!body_rects.write(body_dst, src, n)) {
+        return false;
       }
+    } else if (body_format != ImageDecoder::FORMAT_RGB888 &&
+               !body_decoder.write(src, n)) {
+      return false;
+    } else if (body_format == ImageDecoder::FORMAT_RGB888) {
+      memcpy(body_dst + body_pos, src, n);
+    }
+    body_pos += n;
+    return true;
+  }
 
-      return sendReplyStatus(200, "OK", "");
+  // Returns whether a comma-separated header value contains the token,
+  // ignoring any parameters after a semicolon.
+  static bool hasToken(const char* value, const char* token) {
+    size_t len = strlen(token);
+    while (*value) {
+      value += strspn(value, " \t,");
+      size_t n = strcspn(value, " \t,;");
+      if (n == len && strncasecmp(value, token, len) == 0) {
+        return true;
+      }
+      value += n;
+      value += strcspn(value, ",");
     }
+    return false;
+  }
 
-    // Should have rejected this at the end of the headers.
-    return sendReplyStatus(500, "Internal Server Error", "");
+  // Returns whether an Accept-Encoding value allows the coding, either by
+  // name or through "*", where a weight of q=0 refuses it. The named entry
+  // takes precedence over "*".
+  static bool acceptsEncoding(const char* value, const char* coding) {
+    size_t len = strlen(coding);
+    // Each is -1 if absent, otherwise whether the entry accepts.
+    int named = -1;
+    int wildcard = -1;
+    while (*value) {
+      value += strspn(value, " \t,");
+      size_t n = strcspn(value, " \t,;");
+      bool match = n == len && strncasecmp(value, coding, len) == 0;
+      bool star = n == 1 && *value == '*';
+      value += n;
+
+      bool accept = true;
+      while (*value && *value != ',') {
+        value += strspn(value, " \t;");
+        if ((value[0] == 'q' || value[0] == 'Q') && value[1] == '=') {
+          accept = strtod(value + 2, NULL) > 0;
+        }
+        value += strcspn(value, ";,");
+      }
+
+      if (match) {
+        named = accept;
+      } else if (star) {
+        wildcard = accept;
+      }
+    }
+    return named >= 0 ? named > 0 : wildcard > 0;
   }
 
-  bool checkAuthorization(const char* auth) {
-    String expect("Basic ");
-    {
-      Base64Encoder encoder(expect);
-      encoder.print(config_json["http"]["user"].as<const char*>());
-      encoder.print(':');
-      encoder.print(config_json["http"]["pass"].as<const char*>());
+  // Starts a reply after any pipelined request data, with the status line
+  // and Connection header. The caller continues with "\r\n" and any other
+  // headers.
+  void printStatusLine(int code, const char* title) {
+    // The request has been consumed, so only pipelined data is kept and the
+    // reply has the rest of the buffer.
+    data->compact();
+    data->clearWriteError();
+    reply_offset = data->size();
+    reply_keep_alive = keep_alive && request_consumed;
+
+    data->print("HTTP/1.1 ");
+    data->print(code);
+    data->print(" ");
+    data->print(title);
+    if (reply_keep_alive) {
+      data->print("\r\nConnection: keep-alive\r\nKeep-Alive: timeout=");
+      data->print(HTTP_KEEP_ALIVE_MS / 1000);
+    } else {
+      data->print("\r\nConnection: close");
     }
-    return expect == auth;
   }
 
-  const site_entry* findSiteFile(const char* name) {
-    for (size_t i = 0; site_table[i].name; i++) {
-      if (strcmp(name, site_table[i].name) == 0) {
-        return &site_table[i];
+  // Sends the reply that follows reply_offset in data. If its headers did not
+  // fit, it is replaced with a 500, or the connection is closed if that does
+  // not fit either.
+  State finishReply() {
+    if (data->getWriteError()) {
+      Serial.printf("%lu: http reply headers do not fit\n", millis());
+      data->truncate(reply_offset);
+      reply_body = NULL;
+      reply_body_len = 0;
+      reply_body_image = false;
+      if (reply_failed) {
+        return STATE_CLOSE;
       }
+      reply_failed = true;
+      return sendReplyStatus(500, "Internal Server Error", "");
     }
-    return NULL;
+
+    reply_data = data->begin() + reply_offset;
+    reply_pos = 0;
+    reply_len = data->size() - reply_offset;
+    return STATE_WRITING_REPLY;
   }
 
   State sendReplyData(int code,
@@ -570,93 +2142,212 @@ class HttpServerConnection {
                       const size_t length,
                       const char* encoding,
                       const void* body) {
-    data.advanceBegin(data.size());
-    data.print("HTTP/1.1 ");
-    data.print(code);
-    data.print(" ");
-    data.print(title);
-    data.print("\r\nConnection: close\r\nContent-Type: ");
-    data.print(type);
-    data.print("\r\nContent-Length: ");
-    data.print(length);
+    printReplyHeaders(code, title, type, length, encoding);
+    reply_body = reinterpret_cast<const uint8_t*>(body);
+    reply_body_len = length;
+    return finishReply();
+  }
+
+  // Replies with the current image in the original RGBA layout.
+  State sendReplyImage() {
+    printReplyHeaders(200, "OK", "application/octet-stream", IMAGE_FILE_SIZE,
+                      NULL);
+    reply_body_image = true;
+    reply_body_len = IMAGE_FILE_SIZE;
+    return finishReply();
+  }
+
+  // Offers the socket up to limit bytes of the reply, setting want to how
+  // many were offered, and returns how many it accepted.
+  size_t writeReplyChunk(size_t limit, size_t* want) {
+    if (reply_pos < reply_len) {
+      *want = min(limit, reply_len - reply_pos);
+      return sock.write(reply_data + reply_pos, *want);
+    }
+
+    size_t pos = reply_pos - reply_len;
+    if (reply_body_image) {
+      // Rows are read from whichever image is current when they are sent, so
+      // a reply that is slower than the animation may mix two frames.
+      uint8_t rgba[IMAGE_WIDTH * 4];
+      size_t offset = pos % sizeof(rgba);
+      expandImageRow(image_bin, pos / sizeof(rgba), rgba);
+      *want = min(limit, sizeof(rgba) - offset);
+      return sock.write(rgba + offset, *want);
+    }
+    *want = min(limit, reply_body_len - pos);
+    return sock.write(reply_body + pos, *want);
+  }
+
+  void printReplyHeaders(int code,
+                         const char* title,
+                         const char* type,
+                         const size_t length,
+                         const char* encoding) {
+    printStatusLine(code, title);
+    printContentHeaders(type, length, encoding);
+    data->print("\r\n\r\n");
+  }
+
+  void printContentHeaders(const char* type,
+                           const size_t length,
+                           const char* encoding) {
+    data->print("\r\nContent-Type: ");
+    data->print(type);
+    data->print("\r\nContent-Length: ");
+    data->print(length);
     if (encoding) {
-      data.print("\r\nContent-Encoding: ");
-      data.print(encoding);
+      data->print("\r\nContent-Encoding: ");
+      data->print(encoding);
     }
-    data.print("\r\n\r\n");
-    data.write(reinterpret_cast<const uint8_t*>(body), length);
-    // TODO: Check for errors.
+  }
 
-    reply_data = data.begin();
-    reply_pos = 0;
-    reply_len = data.size();
-    return STATE_WRITING_REPLY;
+  // Replies with a site file, gzipped if the client accepts it and the build
+  // stored a smaller gzip copy, or with 304 if the client already has it.
+  State sendReplyFile(const site_entry* file) {
+    bool gzip = file->gzip_length && accept_encoding &&
+                acceptsEncoding(accept_encoding, "gzip");
+
+    // Both encodings share the content hash, so either ETag matches.
+    bool cached = if_none_match && file->etag &&
+                  (strstr(if_none_match, file->etag) ||
+                   strcmp(if_none_match, "*") == 0);
+
+    printStatusLine(cached ? 304 : 200, cached ? "Not Modified" : "OK");
+    if (!cached && gzip) {
+      printContentHeaders(file->type, file->gzip_length, "gzip");
+    } else if (!cached) {
+      printContentHeaders(file->type, file->length, file->encoding);
+    }
+    if (file->etag) {
+      data->print("\r\nETag: \"");
+      data->print(file->etag);
+      data->print(gzip ? "-gzip\"" : "\"");
+    }
+    if (file->cache_control) {
+      data->print("\r\nCache-Control: ");
+      data->print(file->cache_control);
+    }
+    if (file->gzip_length) {
+      data->print("\r\nVary: Accept-Encoding");
+    }
+    data->print("\r\n\r\n");
+
+    if (!cached) {
+      reply_body = site_data + (gzip ? file->gzip_offset : file->offset);
+      reply_body_len = gzip ? file->gzip_length : file->length;
+    }
+    return finishReply();
   }
 
   State sendReplyJson(int code,
                       const char* title,
                       const JsonDocument& content) {
-    data.advanceBegin(data.size());
-    data.print("HTTP/1.1 ");
-    data.print(code);
-    data.print(" ");
-    data.print(title);
-    data.print(
-        "\r\nConnection: close"
-        "\r\nContent-Type: application/json"
-        "\r\nContent-Length: ");
-    // Reserve six characters for the length, to be filled later.
-    char* content_length_buffer = reinterpret_cast<char*>(data.end());
-    data.print("      \r\n\r\n");
-
-    size_t content_start = data.size();
-    serializeJson(content, data);
-    size_t content_size = data.size() - content_start;
-
-    // TODO: Unhack this!
-    ultoa(content_size, content_length_buffer, 10);
-    char* content_length_end = strchr(content_length_buffer, '\0');
-    if (content_length_end) {
-      *content_length_end = ' ';
-    }
-
-    reply_data = data.begin();
-    reply_pos = 0;
-    reply_len = data.size();
-    return STATE_WRITING_REPLY;
+    HotPathProfiler::Scope profile(profiler, PROFILE_JSON_SERIALIZE);
+    size_t content_size = measureJson(content);
+    printReplyHeaders(code, title, "application/json", content_size, NULL);
+    if (content_size > data->remaining()) {
+      Serial.printf("http reply of %u bytes does not fit\n",
+                    (unsigned)content_size);
+      data->truncate(reply_offset);
+      return sendReplyStatus(500, "Internal Server Error", "");
+    }
+    serializeJson(content, *data);
+
+    return finishReply();
   }
 
   State sendReplyStatus(int code,
                         const char* title,
                         const char* extra_headers) {
-    data.advanceBegin(data.size());
-    data.print("HTTP/1.1 ");
-    data.print(code);
-    data.print(" ");
-    data.print(title);
-    data.print(
+    printStatusLine(code, title);
+    data->print(
         "\r\n"
-        "Connection: close\r\n"
         "Content-Type: text/plain\r\n"
         "Content-Length: ");
-    data.print(strlen(title) + 2);
-    data.print("\r\n");
-    data.print(extra_headers);
-    data.print("\r\n");
-    data.print(title);
-    data.print("\r\n");
-    // TODO: Check for errors.
-
-    reply_data = data.begin();
-    reply_pos = 0;
-    reply_len = data.size();
-    return STATE_WRITING_REPLY;
+    data->print(strlen(title) + 2);
+    data->print("\r\n");
+    data->print(extra_headers);
+    data->print("\r\n");
+    data->print(title);
+    data->print("\r\n");
+    return finishReply();
   }
 };
 
-HttpServerConnection http_connection;
+// The web UI requests the page assets and several API endpoints at once, so a
+// small pool of connections is serviced round-robin. Each slot has its own
+// timeouts, so a stalled client only holds up its own slot.
+#define HTTP_CONNECTIONS (4)
+
+HttpServerConnection http_connections[HTTP_CONNECTIONS];
+
+static void getHttpStats(JsonArray dst) {
+  for (const HttpServerConnection& connection : http_connections) {
+    JsonObject stats = dst.add<JsonObject>();
+    stats["replies"] = connection.tx_replies;
+    stats["tx_bytes"] = connection.tx_bytes;
+    stats["tx_bytes_per_sec"] =
+        connection.tx_us ? connection.tx_bytes * 1000000u / connection.tx_us
+                         : 0;
+    stats["short_writes"] = connection.tx_short_writes;
+    stats["stalls"] = connection.tx_stalls;
+    stats["chunk"] = connection.tx_chunk;
+  }
+}
+
+// The WiFi task runs this often while a request is being read or written.
+#define HTTP_BUSY_PERIOD_MS (5)
+
+// Returns whether any connection is in the middle of a request.
+static bool loopHttp() {
+  // WiFiServer::available returns any client socket with unread data, which
+  // may be one that already has a slot.
+  WiFiClient client = http_server.available();
+  if (client) {
+    HttpServerConnection* slot = NULL;
+    bool found = false;
+    for (HttpServerConnection& connection : http_connections) {
+      if (connection.sock && connection.sock == client) {
+        found = true;
+      } else if (!connection.sock && !slot) {
+        slot = &connection;
+      }
+    }
+    if (found) {
+      slot = NULL;
+    }
+    if (!slot && !found) {
+      // Make room by closing a persistent connection that is between
+      // requests.
+      for (HttpServerConnection& connection : http_connections) {
+        if (connection.isIdle()) {
+          slot = &connection;
+          break;
+        }
+      }
+    }
+    if (slot) {
+      slot->begin(client);
+    }
+  }
+
+  bool busy = false;
+  static size_t next = 0;
+  for (size_t i = 0; i < HTTP_CONNECTIONS; i++) {
+    HttpServerConnection& connection =
+        http_connections[(next + i) % HTTP_CONNECTIONS];
+    if (connection.sock) {
+      connection.run();
+      busy |= connection.sock && !connection.isIdle();
+    }
+  }
+  next = (next + 1) % HTTP_CONNECTIONS;
+  return busy;
+}
 
 static void loopWifi() {
+  HotPathProfiler::Scope profile(profiler, PROFILE_WIFI);
   static enum {
     STATE_IDLE,
     STATE_CONNECTING,
@@ -666,17 +2357,20 @@ static void loopWifi() {
 
   int status = WiFiDrv::getConnectionStatus();
   if (status != WL_CONNECTED) {
+    if (state == STATE_CONNECTED) {
+      // The stream socket is opened again on reconnecting.
+      stream_udp.stop();
+    }
     // Retry the connection after thirty seconds.
     if (state != STATE_CONNECTING || status == WL_DISCONNECTED ||
         (state == STATE_CONNECTING && millis() - state_change_ms > 10000)) {
-      const JsonString& ssid = config_json["wifi"]["ssid"];
-      const JsonString& pass = config_json["wifi"]["pass"];
-      if (ssid && pass) {
-        Serial.printf("%lu: wifi connecting to %s\n", millis(), ssid.c_str());
+      const char* ssid = settings.wifi_ssid;
+      const char* pass = settings.wifi_pass;
+      if (*ssid && *pass) {
+        Serial.printf("%lu: wifi connecting to %s\n", millis(), ssid);
         // This is the same operation run from wifi.begin(...), but that wrapper
         // may block for a long time waiting for the connection to succeed.
-        WiFiDrv::wifiSetPassphrase(ssid.c_str(), ssid.size(), pass.c_str(),
-                                   pass.size());
+        WiFiDrv::wifiSetPassphrase(ssid, strlen(ssid), pass, strlen(pass));
         state = STATE_CONNECTING;
         state_change_ms = millis();
       } else {
@@ -691,24 +2385,24 @@ static void loopWifi() {
     state = STATE_CONNECTED;
     state_change_ms = millis();
 
-    const JsonString& name = config_json["wifi"]["name"];
-    if (name) {
+    const char* name = settings.wifi_name;
+    if (*name) {
       Serial.printf("%lu: mdns begin ", millis());
       wifi.localIP().printTo(Serial);
-      Serial.printf(" '%s'\n", name.c_str());
-      mdns.begin(wifi.localIP(), name.c_str());
+      Serial.printf(" '%s'\n", name);
+      mdns.begin(wifi.localIP(), name);
     }
 
     http_server.begin();
+    stream_udp.begin(DDP_PORT);
   } else {
-    // Run normal network services.
+    // Run normal network services. Streams are polled as often as busy
+    // connections, so frames are not held up by the usual period.
     mdns.run();
-
-    if (!http_connection.sock) {
-      http_connection.begin(http_server.available());
-    }
-    if (http_connection.sock) {
-      http_connection.run();
+    bool busy = loopHttp();
+    busy |= loopStream();
+    if (busy) {
+      scheduler.schedule(TASK_WIFI, HTTP_BUSY_PERIOD_MS);
     }
   }
 }
@@ -725,6 +2419,7 @@ static bool checkJsonFile(const char* path, JsonDocument& dst) {
         mtime != (dst)["_mtime"]) {
       Serial.printf("%lu: loaded %s\n", millis(), path);
       changed = true;
+      HotPathProfiler::Scope profile(profiler, PROFILE_JSON_PARSE);
       deserializeJson(dst, file);
       (dst)["_mdate"] = mdate;
       (dst)["_mtime"] = mtime;
@@ -738,111 +2433,119 @@ static bool checkJsonFile(const char* path, JsonDocument& dst) {
   return changed;
 }
 
-void setup() {
-  setupFlash();
-  setupMatrix();
-
-  flash_changed_flag = true;
-  flash_changed_ms = millis();
-}
-
-void loop() {
-  if (flash_changed_flag && millis() - flash_changed_ms > 1000) {
-    flash_changed_flag = false;
-    flash_changed_ms = 0;
-
-    // Changes to the flash override anything from the web server.
-    image_saving = false;
-
-    if (!flash_fat_ok) {
-      flash_fat_ok = flash_fat.begin(&flash);
-    }
-
-    if (checkJsonFile("/config.json", config_json)) {
-      wifi.disconnect();
-    }
-
-    checkJsonFile("/frames.json", frames_json);
+static void loopFlash() {
+  // Wait for the host to finish writing before reloading, and for any
+  // upload, patch or stream to let go of image_back, where image.bin is read.
+  if (!flash_changed_flag || millis() - flash_changed_ms <= 1000 ||
+      image_back_owner) {
+    return;
+  }
+  flash_changed_flag = false;
+  flash_changed_ms = 0;
 
-    File32 file = flash_fat.open("/image.bin", O_BINARY | O_RDONLY);
-    bzero(image_bin, sizeof(image_bin));
-    if (file) {
-      if (file.size() == sizeof(image_bin)) {
-        file.readBytes((uint8_t*)image_bin, sizeof(image_bin));
-      }
-      file.close();
-    }
+  // Changes to the flash override anything from the web server.
+  scheduler.cancel(TASK_SAVE_IMAGE);
 
-    // Always display the newly-loaded image for a while.
-    image_showing = true;
-    image_showing_stamp = millis();
+  if (!flash_fat_ok) {
+    flash_fat_ok = flash_fat.begin(&flash);
   }
 
-  // Throttle polling the ESP32 to once every 50ms.
-  static unsigned long last_wifi = millis();
-  if (millis() - last_wifi > 50) {
-    last_wifi = millis();
-    loopWifi();
+  if (checkJsonFile("/config.json", config_json)) {
+    loadConfigSettings();
+    updateHttpAuth();
+    wifi.disconnect();
   }
 
-  // Apply the time of day value every thirty seconds.
-  if (millis() - image_showing_stamp > 30000) {
-    int hm = getHoursMinutes();
-    if (hm >= 0) {
-      int morning = getMorning();
-      int evening = getEvening();
-      if (morning < evening) {
-        image_showing = (hm <= morning || hm >= evening);
-      } else {
-        image_showing = (hm >= morning || hm <= evening);
-      }
-      image_showing_stamp = millis();
-    }
+  recoverFile(&frames_file);
+  recoverFile(&image_file);
+
+  if (checkJsonFile("/frames.json", frames_json)) {
+    matrix_lut_stale = true;
+    loadFrameSettings();
+    // The next save rewrites it in our own formatting.
+    frames_file.known = false;
   }
 
-  // Throttle matrix refresh to once every second.
-  if (millis() - image_refresh_stamp > 1000) {
-    image_refresh_stamp = millis();
-    loopMatrix();
+  File32 file = flash_fat.open("/image.bin", O_BINARY | O_RDONLY);
+  bool loaded = file && readImageFile(file, image_back);
+  file.close();
+  if (!loaded) {
+    bzero(image_back, sizeof(Image));
   }
+  swapImageBuffers();
+  // A missing or bad file must be rewritten by the next save, even if the
+  // new image is as black as the fallback.
+  if (loaded) {
+    rememberFile(&image_file, writeImage);
+  } else {
+    image_file.known = false;
+  }
+  startAnimation();
 
-  if (image_saving && millis() - image_saving_stamp > 1000) {
-    image_saving = false;
+  // Always display the newly-loaded image for a while.
+  setImageShowing(true);
+  scheduler.schedule(TASK_DAY_NIGHT, 30000);
+  scheduler.schedule(TASK_MATRIX, 0);  // Refresh immediately.
+}
 
-    File32 file = flash_fat.open("/image.bin", O_CREAT | O_TRUNC | O_WRONLY);
-    if (file) {
-      Serial.printf("%lu: writing /image.bin\n", millis());
-      file.write(image_bin, sizeof(image_bin));
+static void loopDayNight() {
+  int hm = getHoursMinutes();
+  if (hm < 0) {
+    // Keep trying until the time is known.
+    scheduler.schedule(TASK_DAY_NIGHT, 1000);
+    return;
+  }
 
-      if (!file.close()) {
-        Serial.printf("%lu: error flushing /image.bin\n", millis());
-      }
-    } else {
-      Serial.printf("%lu: error writing /image.bin\n", millis());
-    }
+  int morning = getMorning();
+  int evening = getEvening();
+  if (morning < evening) {
+    setImageShowing(hm <= morning || hm >= evening);
+  } else {
+    setImageShowing(hm >= morning || hm <= evening);
   }
+}
 
-  if (frames_saving && millis() - frames_saving_stamp > 1000) {
-    frames_saving = false;
+static void saveImage() {
+  saveFile(&image_file, writeImage);
+}
 
-    File32 file;
-    if (file.open(&flash_fat, "frames.json", O_CREAT | O_TRUNC | O_WRONLY)) {
-      Serial.printf("%lu: writing frames.json\n", millis());
-      frames_json.remove("_mdate");
-      frames_json.remove("_mtime");
+static void saveFrames() {
+  frames_json.remove("_mdate");
+  frames_json.remove("_mtime");
+  saveFile(&frames_file, writeFrames);
+
+  uint16_t mdate = 0, mtime = 0;
+  File32 file = flash_fat.open("/frames.json");
+  file.getModifyDateTime(&mdate, &mtime);
+  file.close();
+  frames_json["_mdate"] = mdate;
+  frames_json["_mtime"] = mtime;
+  compactJson(frames_json, frames_json_arena);
+}
 
-      serializeJsonPretty(frames_json, file);
+void setup() {
+  HotPathProfiler::begin();
+  setupFlash();
+  setupMatrix();
 
-      uint16_t mdate = 0, mtime = 0;
-      file.getModifyDateTime(&mdate, &mtime);
-      frames_json["_mdate"] = mdate;
-      frames_json["_mtime"] = mtime;
+  // Tasks with the earliest deadline run first. Polling the ESP32 is the most
+  // latency sensitive, and runs more often while requests are in flight. The
+  // matrix refreshes every second, or as soon as it is scheduled. Saves wait a
+  // second after the last change, so a burst of changes is written once.
+  scheduler.setTask(TASK_FLASH, "flash", loopFlash, 100, 1000, 1);
+  scheduler.setTask(TASK_WIFI, "wifi", loopWifi, 50, 50, 3);
+  scheduler.setTask(TASK_MATRIX, "matrix", loopMatrix, 1000, 100, 2);
+  scheduler.setTask(TASK_DAY_NIGHT, "day_night", loopDayNight, 30000, 1000, 1);
+  scheduler.setTask(TASK_SAVE_IMAGE, "save_image", saveImage, 0, 1000, 0);
+  scheduler.setTask(TASK_SAVE_FRAMES, "save_frames", saveFrames, 0, 1000, 0);
+  scheduler.setTask(TASK_CLOCK, "clock", syncClock, CLOCK_SYNC_MS, 10000, 0);
 
-      if (!file.close()) {
-        Serial.printf("%lu: error flushing frames.json\n", millis());
-      }
-    } else {
-      Serial.printf("%lu: error writing frames.json\n", millis());
-    }
-  }
+  flash_changed_flag = true;
+  flash_changed_ms = millis();
+}
+
+void loop() {
+  // Animation frames are timed in microseconds, so are checked on every pass.
+  loopAnimation();
+  scheduler.run();
 }
@@ -26,6 +26,105 @@ function offsetHmm(hmm: number, deltaMinutes: number): number {
   return minsToHmm((((hmmToMins(hmm) + deltaMinutes) % 1440) + 1440) % 1440);
 }
 
+// Describes the browser's timezone as a POSIX TZ rule for the billboard, from
+// where this year's UTC offset changes. See Clock.hh for the format.
+function posixTimezone(): string {
+  const year = new Date().getFullYear();
+  const offsetAt = (ms: number) => -new Date(ms).getTimezoneOffset();
+  // POSIX offsets are hours west of UTC.
+  const formatOffset = (mins: number) => {
+    const abs = Math.abs(mins);
+    const hours = `${mins > 0 ? "-" : ""}${Math.floor(abs / 60)}`;
+    return abs % 60 ? `${hours}:${String(abs % 60).padStart(2, "0")}` : hours;
+  };
+
+  // Find the first minute of each offset change by day, then binary search.
+  const changes: number[] = [];
+  const start = new Date(year, 0, 1).getTime();
+  for (let day = 0; day < 365; day++) {
+    let lo = start + day * 86400000;
+    let hi = lo + 86400000;
+    if (offsetAt(lo) === offsetAt(hi)) continue;
+    while (hi - lo > 60000) {
+      const mid = lo + Math.floor((hi - lo) / 120000) * 60000;
+      if (offsetAt(mid) === offsetAt(lo)) lo = mid;
+      else hi = mid;
+    }
+    changes.push(hi);
+  }
+
+  const std = Math.min(offsetAt(start), offsetAt(start + 182 * 86400000));
+  if (changes.length !== 2) {
+    return `STD${formatOffset(std)}`;
+  }
+
+  // Rules give the local time just before the change, like M3.2.0/2.
+  const rule = (ms: number) => {
+    const local = new Date(ms - 60000);
+    const date = new Date(ms - 60000 + offsetAt(ms - 60000) * 60000);
+    const days = new Date(year, local.getMonth() + 1, 0).getDate();
+    const week =
+      local.getDate() + 7 > days ? 5 : Math.ceil(local.getDate() / 7);
+    const mins = date.getUTCHours() * 60 + date.getUTCMinutes() + 1;
+    const time = mins === 120 ? "" : `/${formatOffset(-mins)}`;
+    return `M${local.getMonth() + 1}.${week}.${local.getDay()}${time}`;
+  };
+  const [first, second] = changes;
+  const [dstStart, dstEnd] =
+    offsetAt(first) > offsetAt(second) ? [first, second] : [second, first];
+  return (
+    `STD${formatOffset(std)}DST${formatOffset(offsetAt(dstStart))}` +
+    `,${rule(dstStart)},${rule(dstEnd)}`
+  );
+}
+
+// Schedule times are HMM in the billboard's timezone, or sunrise or sunset.
+function parseScheduleTime(value: string): number | string {
+  const text = value.trim().toLowerCase();
+  return text === "sunrise" || text === "sunset" ? text : parseInt(text, 10);
+}
+
+// Packs RGBA pixels for upload, as run-length packets when that is smaller and
+// otherwise as plain RGB888. See ImageDecoder.hh for the packet format.
+function encodeImage(rgba: Uint8ClampedArray): [string, Uint8Array] {
+  const pixels = rgba.length / 4;
+  const same = (a: number, b: number) =>
+    rgba[a * 4] === rgba[b * 4] &&
+    rgba[a * 4 + 1] === rgba[b * 4 + 1] &&
+    rgba[a * 4 + 2] === rgba[b * 4 + 2];
+
+  const rle: number[] = [];
+  let literal: number[] = [];
+  const flushLiteral = () => {
+    for (let i = 0; i < literal.length; i += 64 * 3) {
+      const chunk = literal.slice(i, i + 64 * 3);
+      rle.push(chunk.length / 3 - 1, ...chunk);
+    }
+    literal = [];
+  };
+  for (let i = 0; i < pixels; ) {
+    let run = 1;
+    while (i + run < pixels && run < 64 && same(i, i + run)) run++;
+    if (run > 1) {
+      flushLiteral();
+      rle.push(0x40 | (run - 1), rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2]);
+    } else {
+      literal.push(rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2]);
+    }
+    i += run;
+  }
+  flushLiteral();
+
+  if (rle.length < pixels * 3) {
+    return ["image/x-rgb-rle", new Uint8Array(rle)];
+  }
+  const rgb = new Uint8Array(pixels * 3);
+  for (let i = 0; i < pixels; i++) {
+    rgb.set(rgba.subarray(i * 4, i * 4 + 3), i * 3);
+  }
+  return ["image/x-rgb888", rgb];
+}
+
 const display = assertNotNull(
   document.getElementById("display"),
 ) as HTMLCanvasElement;
@@ -70,9 +169,13 @@ openImageButton.addEventListener("click", () => {
       postImageController?.abort();
       postImageController = new AbortController();
 
+      const [type, body] = encodeImage(
+        g.getImageData(0, 0, WIDTH, HEIGHT).data,
+      );
       fetch("/api/image", {
         method: "POST",
-        body: g.getImageData(0, 0, WIDTH, HEIGHT).data,
+        headers: { "Content-Type": type },
+        body,
         signal: postImageController.signal,
       });
     }
@@ -123,27 +226,17 @@ gainNumber.addEventListener("change", () => {
   postGain(value);
 });
 
-const postMorning = coalesceFetch("/api/time", (value: unknown) => ({
+const postTime = coalesceFetch("/api/time", () => ({
   method: "POST",
-  body: JSON.stringify(value),
+  body: JSON.stringify({
+    morning: parseScheduleTime(timeMorning.value),
+    evening: parseScheduleTime(timeEvening.value),
+    timezone: posixTimezone(),
+  }),
 }));
 
-timeMorning.addEventListener("change", () => {
-  const offset = new Date().getTimezoneOffset();
-  const morning = offsetHmm(parseInt(timeMorning.value, 10), offset);
-  postMorning({ morning });
-});
-
-const postEvening = coalesceFetch("/api/time", (value: unknown) => ({
-  method: "POST",
-  body: JSON.stringify(value),
-}));
-
-timeEvening.addEventListener("change", () => {
-  const offset = new Date().getTimezoneOffset();
-  const evening = offsetHmm(parseInt(timeEvening.value, 10), offset);
-  postEvening({ evening });
-});
+timeMorning.addEventListener("change", () => postTime());
+timeEvening.addEventListener("change", () => postTime());
 
 fetch("/api/image")
   .then((res) => res.arrayBuffer())
@@ -166,7 +259,12 @@ fetch("/api/gain")
 fetch("/api/time")
   .then((res) => res.json())
   .then((data) => {
-    const offset = new Date().getTimezoneOffset();
-    timeMorning.value = offsetHmm(Number(data.morning), -offset).toFixed(0);
-    timeEvening.value = offsetHmm(Number(data.evening), -offset).toFixed(0);
+    // Without a timezone, the billboard still has times in UTC.
+    const offset = data.timezone ? 0 : new Date().getTimezoneOffset();
+    const show = (value: unknown) =>
+      typeof value === "number"
+        ? offsetHmm(value, -offset).toFixed(0)
+        : String(value);
+    timeMorning.value = show(data.morning);
+    timeEvening.value = show(data.evening);
   });
@@ -0,0 +1,39 @@
+#ifndef TEST_FIRMWARE_HH_
+#define TEST_FIRMWARE_HH_
+
+// Builds the firmware into a native test, so its internals can be called
+// directly. Its setup() and loop() are renamed out of the way, and nothing
+// runs until a test calls it.
+#define setup firmwareSetup
+#define loop firmwareLoop
+#include "../src/main.cpp"
+#undef setup
+#undef loop
+
+#include <signal.h>
+#include <unity.h>
+
+// Reports a benchmark figure, which "pio test -v" shows with the results.
+static void testReport(const char* format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void testReport(const char* format, ...) {
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  TEST_MESSAGE(message);
+}
+
+// Ticks are nanoseconds on the host, as in /api/profile.
+static double ticksToMicros(uint64_t ticks) {
+  return ticks * 1e6 / HotPathProfiler::ticksPerSecond();
+}
+
+static void beginFirmwareTest() {
+  signal(SIGPIPE, SIG_IGN);
+  HotPathProfiler::begin();
+}
+
+#endif  // TEST_FIRMWARE_HH_
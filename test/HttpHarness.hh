@@ -0,0 +1,215 @@
+#ifndef TEST_HTTP_HARNESS_HH_
+#define TEST_HTTP_HARNESS_HH_
+
+// Runs the firmware's web server and talks to it over loopback, as a browser
+// or script would talk to the board.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "Firmware.hh"
+
+// WiFiServer moves port 80 up to 8080 on the host.
+#define HTTP_TEST_PORT (8080)
+
+// The credentials the server is started with, as "test:test".
+#define HTTP_TEST_AUTH "Basic dGVzdDp0ZXN0"
+
+// Starts the server with the test credentials. Tests that call loopHttp()
+// themselves, so they control when requests are read, start it with this
+// instead of HttpServerThread.
+static void beginHttpServer() {
+  bzero(http_auth_tokens, sizeof(http_auth_tokens));
+  http_auth_token_count = 0;
+  addHttpAuthBasic("test", "test");
+  http_server.begin();
+}
+
+// Closes every connection.
+static void resetHttpServer() {
+  for (HttpServerConnection& connection : http_connections) {
+    connection.clear();
+  }
+}
+
+// Calls loopHttp() on its own thread until stopped. The periods are how long
+// to wait between calls while a request is in progress and while idle, which
+// are HTTP_BUSY_PERIOD_MS and the WiFi task period on the device. Firmware
+// state must only be inspected while the server is stopped.
+class HttpServerThread {
+ public:
+  void start(unsigned busy_ms, unsigned idle_ms) {
+    beginHttpServer();
+    stopping_ = false;
+    thread_ = std::thread([this, busy_ms, idle_ms]() {
+      while (!stopping_) {
+        bool busy = loopHttp();
+        usleep((busy ? busy_ms : idle_ms) * 1000 + 50);
+      }
+    });
+  }
+
+  // Stops the thread and closes every connection.
+  void stop() {
+    stopping_ = true;
+    thread_.join();
+    resetHttpServer();
+  }
+
+ private:
+  std::thread thread_;
+  std::atomic<bool> stopping_;
+};
+
+// Returns a blocking socket connected to the server, or -1. A receive buffer
+// size limits how much the server can send ahead of the client reading.
+static int connectHttp(int timeout_ms = 5000, int rcvbuf = 0) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (rcvbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(HTTP_TEST_PORT);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool sendAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool sendAll(int fd, const std::string& data) {
+  return sendAll(fd, data.data(), data.size());
+}
+
+// Builds a request with the test credentials and any extra header lines,
+// each ending in CRLF.
+static std::string httpRequest(const char* method,
+                               const char* path,
+                               const std::string& headers = "",
+                               const std::string& body = "") {
+  std::string request = std::string(method) + " " + path + " HTTP/1.1\r\n" +
+                        "Host: billboard\r\n" +
+                        "Authorization: " HTTP_TEST_AUTH "\r\n" + headers;
+  if (!body.empty()) {
+    request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  }
+  return request + "\r\n" + body;
+}
+
+struct HttpReply {
+  int status = 0;
+  std::string headers;
+  std::string body;
+
+  // Returns the value of a header, or an empty string.
+  std::string header(const char* name) const {
+    std::string key = std::string("\r\n") + name + ": ";
+    size_t pos = headers.find(key);
+    if (pos == std::string::npos) {
+      return "";
+    }
+    pos += key.size();
+    return headers.substr(pos, headers.find("\r\n", pos) - pos);
+  }
+};
+
+// Receives what has arrived, calling loopHttp() while waiting if pump is set.
+static ssize_t recvHttp(int fd, char* buf, size_t size, bool pump) {
+  if (!pump) {
+    return recv(fd, buf, size, 0);
+  }
+  unsigned long begin = millis();
+  while (millis() - begin < 5000) {
+    loopHttp();
+    ssize_t n = recv(fd, buf, size, MSG_DONTWAIT);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+// Reads one reply, whose body is delimited by Content-Length. Bytes that
+// arrive after it are left in *pending for the next reply. Returns false if
+// the connection closes or times out first.
+static bool readHttpReply(int fd,
+                          HttpReply* reply,
+                          std::string* pending,
+                          bool pump = false) {
+  std::string& in = *pending;
+  size_t end;
+  while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+    char buf[4096];
+    ssize_t n = recvHttp(fd, buf, sizeof(buf), pump);
+    if (n <= 0) {
+      return false;
+    }
+    in.append(buf, n);
+  }
+  reply->headers = in.substr(0, end + 2);
+  reply->status = atoi(in.c_str() + strlen("HTTP/1.1 "));
+  in.erase(0, end + 4);
+
+  size_t length = atol(reply->header("Content-Length").c_str());
+  while (in.size() < length) {
+    char buf[4096];
+    ssize_t n =
+        recvHttp(fd, buf, min(sizeof(buf), length - in.size()), pump);
+    if (n <= 0) {
+      return false;
+    }
+    in.append(buf, n);
+  }
+  reply->body = in.substr(0, length);
+  in.erase(0, length);
+  return true;
+}
+
+static bool readHttpReply(int fd, HttpReply* reply, bool pump = false) {
+  std::string pending;
+  return readHttpReply(fd, reply, &pending, pump);
+}
+
+// Sends a request on a new connection and reads the reply.
+static HttpReply httpExchange(const std::string& request) {
+  HttpReply reply;
+  int fd = connectHttp();
+  if (fd >= 0 && sendAll(fd, request)) {
+    readHttpReply(fd, &reply);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return reply;
+}
+
+#endif  // TEST_HTTP_HARNESS_HH_
@@ -0,0 +1,167 @@
+// Stresses the JSON arenas with random allocations, frees and reallocations,
+// checking that blocks keep their contents and that the arena is whole again
+// once everything is freed. Built with AddressSanitizer, as in the
+// native_asan environment, freed arena bytes are poisoned too, so a stray
+// access fails the test.
+
+#include <random>
+#include <vector>
+
+#include "../Firmware.hh"
+
+#define ARENA_STRESS_SIZE (4096)
+#define ARENA_STRESS_STEPS (200000)
+#define ARENA_STRESS_MAX_LIVE (30)
+
+struct ArenaBlock {
+  uint8_t* ptr;
+  size_t size;
+  uint8_t tag;
+};
+
+static bool checkBlock(const ArenaBlock& block, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (block.ptr[i] != block.tag) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void freeAll(ArenaAllocator* arena, std::vector<ArenaBlock>* blocks) {
+  for (const ArenaBlock& block : *blocks) {
+    TEST_ASSERT_TRUE(checkBlock(block, block.size));
+    arena->deallocate(block.ptr);
+  }
+  blocks->clear();
+  TEST_ASSERT_EQUAL(0, arena->live());
+  TEST_ASSERT_EQUAL(0, arena->wasted());
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_top_block_reclaimed() {
+  StaticArenaAllocator<256> arena;
+  void* a = arena.allocate(10);
+  void* b = arena.allocate(20);
+  TEST_ASSERT_EQUAL(56, arena.live());
+
+  arena.deallocate(b);
+  TEST_ASSERT_EQUAL(24, arena.live());
+  TEST_ASSERT_EQUAL(0, arena.wasted());
+  TEST_ASSERT_EQUAL_PTR(b, arena.allocate(20));
+  (void)a;
+}
+
+static void test_block_below_top_wasted() {
+  StaticArenaAllocator<256> arena;
+  void* a = arena.allocate(10);
+  void* b = arena.allocate(20);
+  arena.deallocate(a);
+  TEST_ASSERT_EQUAL(24, arena.wasted());
+
+  // Freeing the last live block resets the arena.
+  arena.deallocate(b);
+  TEST_ASSERT_EQUAL(0, arena.live());
+  TEST_ASSERT_EQUAL(0, arena.wasted());
+  TEST_ASSERT_EQUAL_PTR(a, arena.allocate(10));
+}
+
+static void test_top_block_grows_in_place() {
+  StaticArenaAllocator<256> arena;
+  arena.allocate(10);
+  uint8_t* b = static_cast<uint8_t*>(arena.allocate(8));
+  memset(b, 0x5a, 8);
+  uint8_t* grown = static_cast<uint8_t*>(arena.reallocate(b, 100));
+  TEST_ASSERT_EQUAL_PTR(b, grown);
+  TEST_ASSERT_EACH_EQUAL_UINT8(0x5a, grown, 8);
+  TEST_ASSERT_EQUAL(24 + 112, arena.live());
+  TEST_ASSERT_EQUAL(0, arena.wasted());
+}
+
+static void test_block_below_top_moves() {
+  StaticArenaAllocator<256> arena;
+  uint8_t* a = static_cast<uint8_t*>(arena.allocate(8));
+  memset(a, 0x3c, 8);
+  arena.allocate(8);
+  uint8_t* moved = static_cast<uint8_t*>(arena.reallocate(a, 40));
+  TEST_ASSERT_TRUE(moved != a);
+  TEST_ASSERT_EACH_EQUAL_UINT8(0x3c, moved, 8);
+  TEST_ASSERT_EQUAL(16, arena.wasted());
+}
+
+static void test_overflow_to_heap() {
+  StaticArenaAllocator<64> arena;
+  void* a = arena.allocate(40);
+  void* b = arena.allocate(40);
+  TEST_ASSERT_NOT_NULL(b);
+  TEST_ASSERT_EQUAL(1, arena.overflows());
+  TEST_ASSERT_EQUAL(48, arena.live());
+
+  arena.deallocate(b);
+  arena.deallocate(a);
+  TEST_ASSERT_EQUAL(0, arena.live());
+}
+
+static void test_random_stress() {
+  StaticArenaAllocator<ARENA_STRESS_SIZE> arena;
+  std::mt19937 random(1);
+  std::vector<ArenaBlock> blocks;
+  for (int step = 0; step < ARENA_STRESS_STEPS; step++) {
+    int op = random() % 3;
+    if (op == 0 || blocks.empty()) {
+      size_t size = random() % 300 + 1;
+      ArenaBlock block = {static_cast<uint8_t*>(arena.allocate(size)), size,
+                          static_cast<uint8_t>(random())};
+      TEST_ASSERT_NOT_NULL(block.ptr);
+      memset(block.ptr, block.tag, size);
+      blocks.push_back(block);
+    } else {
+      size_t i = random() % blocks.size();
+      ArenaBlock& block = blocks[i];
+      TEST_ASSERT_TRUE(checkBlock(block, block.size));
+      if (op == 1) {
+        arena.deallocate(block.ptr);
+        blocks.erase(blocks.begin() + i);
+      } else {
+        size_t size = random() % 400 + 1;
+        block.ptr = static_cast<uint8_t*>(arena.reallocate(block.ptr, size));
+        TEST_ASSERT_NOT_NULL(block.ptr);
+        TEST_ASSERT_TRUE(checkBlock(block, min(size, block.size)));
+        memset(block.ptr, block.tag, size);
+        block.size = size;
+      }
+    }
+    if (blocks.size() > ARENA_STRESS_MAX_LIVE) {
+      freeAll(&arena, &blocks);
+    }
+  }
+  freeAll(&arena, &blocks);
+  TEST_ASSERT_GREATER_THAN(0, arena.overflows());
+  testReport("%d steps: high water %zu of %zu bytes, %u overflows",
+             ARENA_STRESS_STEPS, arena.highWater(), arena.size(),
+             arena.overflows());
+}
+
+// compactJson() copies a whole document through the temporary arena.
+static void test_compact_fits_temp_arena() {
+  TEST_ASSERT_GREATER_OR_EQUAL(frames_json_arena.size(),
+                               temp_json_arena.size());
+  TEST_ASSERT_GREATER_OR_EQUAL(config_json_arena.size(),
+                               temp_json_arena.size());
+}
+
+int main() {
+  beginFirmwareTest();
+  UNITY_BEGIN();
+  RUN_TEST(test_top_block_reclaimed);
+  RUN_TEST(test_block_below_top_wasted);
+  RUN_TEST(test_top_block_grows_in_place);
+  RUN_TEST(test_block_below_top_moves);
+  RUN_TEST(test_overflow_to_heap);
+  RUN_TEST(test_random_stress);
+  RUN_TEST(test_compact_fits_temp_arena);
+  return UNITY_END();
+}
@@ -0,0 +1,168 @@
+// Checks how replies are built: what happens when one does not fit in the
+// connection buffer behind pipelined request data, and which encoding is
+// chosen for site files. Also checks that clients which never send anything
+// use up the ESP32's sockets.
+
+#include <vector>
+
+#include "../HttpHarness.hh"
+
+static int fd = -1;
+
+void setUp() {
+  fd = connectHttp();
+}
+
+void tearDown() {
+  close(fd);
+  resetHttpServer();
+}
+
+// Follows the request with the start of another, so that room bytes are left
+// in the connection buffer for the reply to the first.
+static std::string withPipelined(const std::string& request, size_t room) {
+  std::string next = "GET / HTTP/1.1\r\nX-Pad: ";
+  next.append(HTTP_BUFFER_SIZE - room - next.size(), 'a');
+  return request + next;
+}
+
+// Returns how much of the buffer the usual reply to the request takes, which
+// is its headers and any body that is built there.
+static size_t measureReply(const std::string& request, bool buffered_body) {
+  int fd = connectHttp();
+  HttpReply reply;
+  TEST_ASSERT_TRUE(sendAll(fd, request));
+  TEST_ASSERT_TRUE(readHttpReply(fd, &reply, true));
+  close(fd);
+  resetHttpServer();
+  return reply.headers.size() + 2 + (buffered_body ? reply.body.size() : 0);
+}
+
+static void test_reply_fits() {
+  std::string request = httpRequest("GET", "/api/image");
+  size_t size = measureReply(request, false);
+
+  HttpReply reply;
+  TEST_ASSERT_TRUE(sendAll(fd, withPipelined(request, size)));
+  TEST_ASSERT_TRUE(readHttpReply(fd, &reply, true));
+  TEST_ASSERT_EQUAL(200, reply.status);
+  TEST_ASSERT_EQUAL(IMAGE_FILE_SIZE, reply.body.size());
+}
+
+// The 401 has a WWW-Authenticate header, so the 500 that replaces it is
+// smaller.
+static void test_reply_replaced_with_500() {
+  std::string request = "GET /api/image HTTP/1.1\r\n\r\n";
+  size_t size = measureReply(request, true);
+
+  HttpReply reply;
+  TEST_ASSERT_TRUE(sendAll(fd, withPipelined(request, size - 1)));
+  TEST_ASSERT_TRUE(readHttpReply(fd, &reply, true));
+  TEST_ASSERT_EQUAL(500, reply.status);
+  TEST_ASSERT_EQUAL_STRING("Internal Server Error\r\n", reply.body.c_str());
+}
+
+// The image headers are smaller than a 500, so there is no room for either.
+static void test_reply_closes() {
+  std::string request = httpRequest("GET", "/api/image");
+  size_t size = measureReply(request, false);
+
+  HttpReply reply;
+  std::string pending;
+  TEST_ASSERT_TRUE(sendAll(fd, withPipelined(request, size - 1)));
+  TEST_ASSERT_FALSE(readHttpReply(fd, &reply, &pending, true));
+  TEST_ASSERT_EQUAL(0, pending.size());
+}
+
+// Site file headers are larger than a 500.
+static void test_file_reply_replaced_with_500() {
+  std::string request = httpRequest("GET", "/");
+  size_t size = measureReply(request, false);
+
+  HttpReply reply;
+  TEST_ASSERT_TRUE(sendAll(fd, withPipelined(request, size - 1)));
+  TEST_ASSERT_TRUE(readHttpReply(fd, &reply, true));
+  TEST_ASSERT_EQUAL(500, reply.status);
+}
+
+static void test_file_gzip_negotiation() {
+  const site_entry* file = site_table;
+  while (file->name && !file->gzip_length) {
+    file++;
+  }
+  TEST_ASSERT_NOT_NULL(file->name);
+
+  static const struct {
+    const char* accept;
+    bool gzip;
+  } cases[] = {
+      {"gzip", true},
+      {"gzip, deflate, br, zstd", true},
+      {"GZIP;q=0.001", true},
+      {"br;q=1.0, gzip ; q=0.8", true},
+      {"*", true},
+      {"deflate, *;q=0.5", true},
+      {"gzip;q=0", false},
+      {"gzip;q=0.000", false},
+      {"gzip;Q=0, *", false},
+      {"*;q=0", false},
+      {"x-gzip", false},
+      {"deflate", false},
+  };
+  std::string pending;
+  for (const auto& c : cases) {
+    std::string header = std::string("Accept-Encoding: ") + c.accept + "\r\n";
+    HttpReply reply;
+    TEST_ASSERT_TRUE(sendAll(fd, httpRequest("GET", file->name, header)));
+    TEST_ASSERT_TRUE(readHttpReply(fd, &reply, &pending, true));
+    TEST_ASSERT_EQUAL(200, reply.status);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(c.gzip ? "gzip" : "",
+                                     reply.header("Content-Encoding").c_str(),
+                                     c.accept);
+    TEST_ASSERT_EQUAL(c.gzip ? file->gzip_length : file->length,
+                      reply.body.size());
+  }
+}
+
+// Returns whether a reply has arrived after polling the server for a while.
+static bool replyArrives(int fd) {
+  for (int i = 0; i < 50; i++) {
+    loopHttp();
+    usleep(1000);
+  }
+  char c;
+  return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1;
+}
+
+static void test_silent_clients_use_sockets() {
+  std::vector<int> silent;
+  for (int i = 0; i < WIFI_MAX_SOCK_NUM; i++) {
+    silent.push_back(connectHttp());
+    loopHttp();
+  }
+  int client = connectHttp();
+  TEST_ASSERT_TRUE(sendAll(client, httpRequest("GET", "/api/rotation")));
+  TEST_ASSERT_FALSE(replyArrives(client));
+
+  // Sockets closed before they sent anything are dropped.
+  for (int fd : silent) {
+    close(fd);
+  }
+  HttpReply reply;
+  TEST_ASSERT_TRUE(readHttpReply(client, &reply, true));
+  TEST_ASSERT_EQUAL(200, reply.status);
+  close(client);
+}
+
+int main() {
+  beginFirmwareTest();
+  beginHttpServer();
+  UNITY_BEGIN();
+  RUN_TEST(test_reply_fits);
+  RUN_TEST(test_reply_replaced_with_500);
+  RUN_TEST(test_reply_closes);
+  RUN_TEST(test_file_reply_replaced_with_500);
+  RUN_TEST(test_file_gzip_negotiation);
+  RUN_TEST(test_silent_clients_use_sockets);
+  return UNITY_END();
+}
@@ -0,0 +1,336 @@
+// Checks ImageDecoder against reference encoders for each upload format, and
+// compares their size on the wire and the time taken to decode them.
+
+#include <vector>
+
+#include "../Firmware.hh"
+
+#define DECODE_BENCH_IMAGES (200)
+
+// The body is handed to the decoder in socket reads of up to this many bytes.
+#define DECODE_CHUNK_SIZE (512)
+
+typedef std::vector<uint8_t> Bytes;
+
+static Image sample_images[6];
+static const char* const sample_names[] = {
+    "solid", "checkerboard", "sparse text", "gradient", "noise", "noise delta",
+};
+#define SAMPLE_COUNT (sizeof(sample_names) / sizeof(sample_names[0]))
+
+// The last sample is the one before it with a small area redrawn, and is
+// encoded against it.
+#define SAMPLE_DELTA (SAMPLE_COUNT - 1)
+
+static void setPixel(Image* image, int x, int y, uint8_t r, uint8_t g,
+                     uint8_t b) {
+  (*image)[y][x][0] = r;
+  (*image)[y][x][1] = g;
+  (*image)[y][x][2] = b;
+}
+
+static void fillSamples() {
+  uint32_t seed = 1;
+  for (int y = 0; y < IMAGE_HEIGHT; y++) {
+    for (int x = 0; x < IMAGE_WIDTH; x++) {
+      setPixel(&sample_images[0], x, y, 32, 96, 160);
+      bool square = ((x / 8) ^ (y / 8)) & 1;
+      setPixel(&sample_images[1], x, y, square ? 255 : 0, 0, square ? 0 : 255);
+      setPixel(&sample_images[3], x, y, x * 4, y * 4, (x + y) * 2);
+      seed = seed * 1103515245 + 12345;
+      setPixel(&sample_images[4], x, y, seed >> 24, seed >> 16, seed >> 8);
+    }
+  }
+
+  // Four lines of 5x7 glyphs in white on black, with random strokes.
+  for (int line = 0; line < 4; line++) {
+    for (int glyph = 0; glyph < 10; glyph++) {
+      for (int y = 0; y < 7; y++) {
+        for (int x = 0; x < 5; x++) {
+          seed = seed * 1103515245 + 12345;
+          if ((seed >> 16) & 1) {
+            setPixel(&sample_images[2], 2 + glyph * 6 + x, 4 + line * 15 + y,
+                     255, 255, 255);
+          }
+        }
+      }
+    }
+  }
+
+  memcpy(sample_images[SAMPLE_DELTA], sample_images[SAMPLE_DELTA - 1],
+         sizeof(Image));
+  for (int y = 20; y < 28; y++) {
+    for (int x = 20; x < 36; x++) {
+      setPixel(&sample_images[SAMPLE_DELTA], x, y, 255, 255, 0);
+    }
+  }
+}
+
+static const Image* sampleReference(size_t sample) {
+  return sample == SAMPLE_DELTA ? &sample_images[sample - 1] : NULL;
+}
+
+static Bytes encodeRgba8888(const Image* image) {
+  Bytes out;
+  const uint8_t* p = &(*image)[0][0][0];
+  for (size_t i = 0; i < IMAGE_PIXELS; i++, p += 3) {
+    out.insert(out.end(), p, p + 3);
+    out.push_back(255);
+  }
+  return out;
+}
+
+static Bytes encodeRgb888(const Image* image) {
+  const uint8_t* p = &(*image)[0][0][0];
+  return Bytes(p, p + sizeof(Image));
+}
+
+static Bytes encodeRgb565(const Image* image) {
+  Bytes out;
+  const uint8_t* p = &(*image)[0][0][0];
+  for (size_t i = 0; i < IMAGE_PIXELS; i++, p += 3) {
+    uint16_t v = ((p[0] & 0xf8) << 8) | ((p[1] & 0xfc) << 3) | (p[2] >> 3);
+    out.push_back(v & 0xff);
+    out.push_back(v >> 8);
+  }
+  return out;
+}
+
+// As encodeImage() in main.ts, plus skip packets for pixels that match the
+// reference image when there is one.
+static Bytes encodeRle(const Image* image, const Image* ref) {
+  const uint8_t* p = &(*image)[0][0][0];
+  const uint8_t* q = ref ? &(*ref)[0][0][0] : NULL;
+  Bytes out;
+  Bytes literal;
+  auto flushLiteral = [&]() {
+    for (size_t i = 0; i < literal.size(); i += 64 * 3) {
+      size_t n = min(literal.size() - i, (size_t)64 * 3);
+      out.push_back(n / 3 - 1);
+      out.insert(out.end(), literal.begin() + i, literal.begin() + i + n);
+    }
+    literal.clear();
+  };
+  for (size_t i = 0; i < IMAGE_PIXELS;) {
+    size_t run = 1;
+    if (q && memcmp(p + i * 3, q + i * 3, 3) == 0) {
+      while (i + run < IMAGE_PIXELS && run < 64 &&
+             memcmp(p + (i + run) * 3, q + (i + run) * 3, 3) == 0) {
+        run++;
+      }
+      flushLiteral();
+      out.push_back(0x80 | (run - 1));
+    } else {
+      while (i + run < IMAGE_PIXELS && run < 64 &&
+             memcmp(p + i * 3, p + (i + run) * 3, 3) == 0) {
+        run++;
+      }
+      if (run > 1) {
+        flushLiteral();
+        out.push_back(0x40 | (run - 1));
+        out.insert(out.end(), p + i * 3, p + i * 3 + 3);
+      } else {
+        literal.insert(literal.end(), p + i * 3, p + i * 3 + 3);
+      }
+    }
+    i += run;
+  }
+  flushLiteral();
+  return out;
+}
+
+static Bytes encode(ImageDecoder::Format format, size_t sample) {
+  const Image* image = &sample_images[sample];
+  switch (format) {
+    case ImageDecoder::FORMAT_RGBA8888:
+      return encodeRgba8888(image);
+    case ImageDecoder::FORMAT_RGB888:
+      return encodeRgb888(image);
+    case ImageDecoder::FORMAT_RGB565:
+      return encodeRgb565(image);
+    case ImageDecoder::FORMAT_RLE:
+      return encodeRle(image, sampleReference(sample));
+  }
+  return Bytes();
+}
+
+// What the decoder should produce, given that RGB565 drops the low bits and
+// expands the rest to full scale.
+static void expectDecoded(ImageDecoder::Format format,
+                          size_t sample,
+                          Image* expect) {
+  memcpy(expect, sample_images[sample], sizeof(Image));
+  if (format != ImageDecoder::FORMAT_RGB565) {
+    return;
+  }
+  uint8_t* p = &(*expect)[0][0][0];
+  for (size_t i = 0; i < IMAGE_PIXELS; i++, p += 3) {
+    uint8_t r = p[0] >> 3;
+    uint8_t g = p[1] >> 2;
+    uint8_t b = p[2] >> 3;
+    p[0] = (r << 3) | (r >> 2);
+    p[1] = (g << 2) | (g >> 4);
+    p[2] = (b << 3) | (b >> 2);
+  }
+}
+
+static bool decode(ImageDecoder::Format format,
+                   size_t sample,
+                   const Bytes& body,
+                   size_t chunk,
+                   Image* dst) {
+  const Image* ref = sampleReference(sample);
+  ImageDecoder decoder;
+  decoder.begin(format, &(*dst)[0][0][0], ref ? &(*ref)[0][0][0] : NULL,
+                IMAGE_PIXELS);
+  for (size_t i = 0; i < body.size(); i += chunk) {
+    if (!decoder.write(&body[i], min(chunk, body.size() - i))) {
+      return false;
+    }
+  }
+  return decoder.done();
+}
+
+static const ImageDecoder::Format formats[] = {
+    ImageDecoder::FORMAT_RGBA8888,
+    ImageDecoder::FORMAT_RGB888,
+    ImageDecoder::FORMAT_RGB565,
+    ImageDecoder::FORMAT_RLE,
+};
+static const char* const format_names[] = {"rgba8888", "rgb888", "rgb565",
+                                           "rle"};
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_decode_matches_encode() {
+  static Image expect;
+  static Image actual;
+  static const size_t chunks[] = {1, 7, DECODE_CHUNK_SIZE};
+  for (size_t s = 0; s < SAMPLE_COUNT; s++) {
+    for (size_t f = 0; f < FORMAT_COUNT; f++) {
+      Bytes body = encode(formats[f], s);
+      TEST_ASSERT_TRUE(
+          ImageDecoder::checkLength(formats[f], body.size(), IMAGE_PIXELS));
+      expectDecoded(formats[f], s, &expect);
+      for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        memset(actual, 0xa5, sizeof(actual));
+        TEST_ASSERT_TRUE(decode(formats[f], s, body, chunks[c], &actual));
+        TEST_ASSERT_EQUAL_MEMORY(expect, actual, sizeof(Image));
+      }
+    }
+  }
+}
+
+static void test_rle_rejects_overflow() {
+  static Image actual;
+  Bytes body = encodeRle(&sample_images[0], NULL);
+  body.push_back(0x40);
+  body.insert(body.end(), 3, 0);
+  TEST_ASSERT_FALSE(
+      decode(ImageDecoder::FORMAT_RLE, 0, body, DECODE_CHUNK_SIZE, &actual));
+
+  static const uint8_t reserved[] = {0xc0};
+  ImageDecoder decoder;
+  decoder.begin(ImageDecoder::FORMAT_RLE, &actual[0][0][0], NULL,
+                IMAGE_PIXELS);
+  TEST_ASSERT_FALSE(decoder.write(reserved, sizeof(reserved)));
+}
+
+// Alternating colours sent as one pixel repeats take four bytes a pixel,
+// which is the most a valid stream can take.
+static void test_rle_single_pixel_packets() {
+  static Image actual;
+  const uint8_t* p = &sample_images[1][0][0][0];
+  Bytes body;
+  for (size_t i = 0; i < IMAGE_PIXELS; i++, p += 3) {
+    body.push_back(0x40);
+    body.insert(body.end(), p, p + 3);
+  }
+  TEST_ASSERT_TRUE(ImageDecoder::checkLength(ImageDecoder::FORMAT_RLE,
+                                             body.size(), IMAGE_PIXELS));
+  TEST_ASSERT_FALSE(ImageDecoder::checkLength(ImageDecoder::FORMAT_RLE,
+                                              body.size() + 1, IMAGE_PIXELS));
+  TEST_ASSERT_TRUE(
+      decode(ImageDecoder::FORMAT_RLE, 1, body, DECODE_CHUNK_SIZE, &actual));
+  TEST_ASSERT_EQUAL_MEMORY(sample_images[1], actual, sizeof(Image));
+}
+
+// Patches a rectangle of the noise sample into the checkerboard. In RLE the
+// first pixel of each row is skipped, so it keeps the checkerboard.
+static void test_patch_rect() {
+  static const size_t chunks[] = {1, 7, DECODE_CHUNK_SIZE};
+  const int x0 = 3, y0 = 4, w = 10, h = 5;
+  const Image& base = sample_images[1];
+  const Image& noise = sample_images[4];
+  static const ImageDecoder::Format patch_formats[] = {
+      ImageDecoder::FORMAT_RGB888, ImageDecoder::FORMAT_RLE};
+  for (ImageDecoder::Format format : patch_formats) {
+    bool rle = format == ImageDecoder::FORMAT_RLE;
+    Bytes body = {x0, y0, w, h};
+    static Image expect;
+    memcpy(expect, base, sizeof(Image));
+    for (int y = y0; y < y0 + h; y++) {
+      if (rle) {
+        body.push_back(0x80);
+        body.push_back(w - 2);
+      }
+      for (int x = x0 + rle; x < x0 + w; x++) {
+        body.insert(body.end(), noise[y][x], noise[y][x] + 3);
+        memcpy(expect[y][x], noise[y][x], 3);
+      }
+    }
+
+    for (size_t chunk : chunks) {
+      static Image actual;
+      memcpy(actual, base, sizeof(Image));
+      RectDecoder<IMAGE_WIDTH> decoder;
+      decoder.begin(format, IMAGE_WIDTH, IMAGE_HEIGHT);
+      for (size_t i = 0; i < body.size(); i += chunk) {
+        TEST_ASSERT_TRUE(decoder.write(&actual[0][0][0], &body[i],
+                                       min(chunk, body.size() - i)));
+      }
+      TEST_ASSERT_TRUE(decoder.done());
+      TEST_ASSERT_EQUAL(y0, decoder.dirtyBegin());
+      TEST_ASSERT_EQUAL(y0 + h, decoder.dirtyEnd());
+      TEST_ASSERT_EQUAL_MEMORY(expect, actual, sizeof(Image));
+    }
+  }
+}
+
+// RGB888 uploads are read straight into the back buffer rather than through
+// the decoder, but it is timed here anyway as it is for patches.
+static void test_benchmark_decode() {
+  static Image actual;
+  for (size_t s = 0; s < SAMPLE_COUNT; s++) {
+    for (size_t f = 0; f < FORMAT_COUNT; f++) {
+      if (formats[f] != ImageDecoder::FORMAT_RLE && s == SAMPLE_DELTA) {
+        continue;
+      }
+      Bytes body = encode(formats[f], s);
+      uint64_t ticks = 0;
+      for (int i = 0; i < DECODE_BENCH_IMAGES; i++) {
+        uint32_t begin = HotPathProfiler::now();
+        decode(formats[f], s, body, DECODE_CHUNK_SIZE, &actual);
+        ticks += HotPathProfiler::now() - begin;
+      }
+      testReport("%-12s %-8s %5zu bytes %6.1f us/image", sample_names[s],
+                 format_names[f], body.size(),
+                 ticksToMicros(ticks) / DECODE_BENCH_IMAGES);
+    }
+  }
+}
+
+int main() {
+  beginFirmwareTest();
+  fillSamples();
+  UNITY_BEGIN();
+  RUN_TEST(test_decode_matches_encode);
+  RUN_TEST(test_rle_rejects_overflow);
+  RUN_TEST(test_rle_single_pixel_packets);
+  RUN_TEST(test_patch_rect);
+  RUN_TEST(test_benchmark_decode);
+  return UNITY_END();
+}
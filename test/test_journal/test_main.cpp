@@ -0,0 +1,142 @@
+// Simulates power loss at every byte of a save: with the journal cut short
+// while it is written, and with the file cut short while the journal is
+// copied over it. Recovery must leave either the old or the new image, and
+// no journal.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "../Firmware.hh"
+
+static char flash_dir[] = "/tmp/billboard-journal-XXXXXX";
+
+static std::string flashPath(const char* path) {
+  return std::string(flash_dir) + path;
+}
+
+static std::string readFile(const char* path) {
+  std::string content;
+  FILE* file = fopen(flashPath(path).c_str(), "rb");
+  if (file) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+      content.append(buf, n);
+    }
+    fclose(file);
+  }
+  return content;
+}
+
+static void writeFile(const char* path, const std::string& content) {
+  FILE* file = fopen(flashPath(path).c_str(), "wb");
+  fwrite(content.data(), 1, content.size(), file);
+  fclose(file);
+}
+
+static bool fileExists(const char* path) {
+  return access(flashPath(path).c_str(), F_OK) == 0;
+}
+
+// Runs recovery with Serial output discarded, since it logs every attempt.
+static void recoverQuietly(SavedFile* saved) {
+  fflush(stdout);
+  int out = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  recoverFile(saved);
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  close(null);
+  close(out);
+}
+
+static std::string old_image;
+static std::string new_image;
+static std::string new_journal;
+
+// Saves two images, keeping the content of each file and the journal that
+// the second leaves just before it is applied.
+static void saveImages() {
+  memset(image_bin, 0x11, sizeof(Image));
+  saveImage();
+  old_image = readFile(image_file.path);
+
+  memset(image_bin, 0x22, sizeof(Image));
+  (*image_bin)[0][0][0] = 7;
+  saveImage();
+  new_image = readFile(image_file.path);
+
+  Crc32 crc;
+  crc.write(reinterpret_cast<const uint8_t*>(new_image.data()),
+            new_image.size());
+  uint32_t trailer[2] = {crc.size(), crc.value()};
+  new_journal = new_image;
+  new_journal.append(reinterpret_cast<const char*>(trailer), sizeof(trailer));
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_save_leaves_no_journal() {
+  TEST_ASSERT_EQUAL(IMAGE_FILE_SIZE, old_image.size());
+  TEST_ASSERT_EQUAL(IMAGE_FILE_SIZE, new_image.size());
+  TEST_ASSERT_TRUE(old_image != new_image);
+  TEST_ASSERT_FALSE(fileExists(image_file.journal_path));
+}
+
+static void test_cut_journal() {
+  for (size_t k = 0; k < new_journal.size(); k++) {
+    writeFile(image_file.path, old_image);
+    writeFile(image_file.journal_path, new_journal.substr(0, k));
+    recoverQuietly(&image_file);
+    TEST_ASSERT_TRUE_MESSAGE(readFile(image_file.path) == old_image,
+                             "old image kept");
+    TEST_ASSERT_FALSE(fileExists(image_file.journal_path));
+  }
+}
+
+static void test_corrupt_journal() {
+  std::string journal = new_journal;
+  journal[journal.size() / 2] ^= 1;
+  writeFile(image_file.path, old_image);
+  writeFile(image_file.journal_path, journal);
+  recoverQuietly(&image_file);
+  TEST_ASSERT_TRUE(readFile(image_file.path) == old_image);
+  TEST_ASSERT_FALSE(fileExists(image_file.journal_path));
+}
+
+static void test_cut_file() {
+  for (size_t k = 0; k <= new_image.size(); k++) {
+    writeFile(image_file.path, new_image.substr(0, k));
+    writeFile(image_file.journal_path, new_journal);
+    recoverQuietly(&image_file);
+    TEST_ASSERT_TRUE_MESSAGE(readFile(image_file.path) == new_image,
+                             "new image recovered");
+    TEST_ASSERT_FALSE(fileExists(image_file.journal_path));
+  }
+}
+
+int main() {
+  mkdtemp(flash_dir);
+  setenv("BILLBOARD_FLASH_DIR", flash_dir, 1);
+  beginFirmwareTest();
+  flash_fat.begin(&flash);
+  saveImages();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_save_leaves_no_journal);
+  RUN_TEST(test_cut_journal);
+  RUN_TEST(test_corrupt_journal);
+  RUN_TEST(test_cut_file);
+  int result = UNITY_END();
+
+  remove(flashPath(image_file.path).c_str());
+  remove(flashPath(image_file.journal_path).c_str());
+  rmdir(flash_dir);
+  return result;
+}
@@ -0,0 +1,138 @@
+// Checks the lookup-table renderer against the drawPixel transform it
+// replaced, and compares the time per frame of the two.
+
+#include "../Firmware.hh"
+
+#define RENDER_BENCH_FRAMES (500)
+
+// GFXcanvas16::drawPixel, with its bounds checks and rotation transform.
+static void drawPixelLegacy(uint16_t* canvas,
+                            int rotation,
+                            int16_t x,
+                            int16_t y,
+                            uint16_t color) {
+  const int16_t w = IMAGE_WIDTH;
+  const int16_t h = IMAGE_HEIGHT;
+  if (x < 0 || y < 0 || x >= w || y >= h) {
+    return;
+  }
+  int16_t t;
+  switch (rotation) {
+    case 1:
+      t = x;
+      x = w - 1 - y;
+      y = t;
+      break;
+    case 2:
+      x = w - 1 - x;
+      y = h - 1 - y;
+      break;
+    case 3:
+      t = x;
+      x = y;
+      y = h - 1 - t;
+      break;
+  }
+  canvas[x + y * w] = color;
+}
+
+// The renderer before the lookup tables: a float multiply and clamp for each
+// channel, color565, and drawPixel for every pixel.
+static void renderLegacy(uint16_t* canvas, int rotation, float gain) {
+  for (int y = 0; y < IMAGE_HEIGHT; y++) {
+    for (int x = 0; x < IMAGE_WIDTH; x++) {
+      const uint8_t* rgb = (*image_bin)[y][x];
+      uint8_t r = constrain(rgb[0] * gain, 0, 255);
+      uint8_t g = constrain(rgb[1] * gain, 0, 255);
+      uint8_t b = constrain(rgb[2] * gain, 0, 255);
+      uint16_t color = ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+      drawPixelLegacy(canvas, rotation, x, y, color);
+    }
+  }
+}
+
+static void fillImage(uint32_t seed) {
+  uint8_t* p = &(*image_bin)[0][0][0];
+  for (size_t i = 0; i < sizeof(Image); i++) {
+    seed = seed * 1103515245 + 12345;
+    p[i] = seed >> 16;
+  }
+}
+
+static void renderFrame(int rotation) {
+  settings.rotation = rotation;
+  image_showing = true;
+  markAllDirty();
+  loopMatrix();
+}
+
+void setUp() {
+  settings = Settings();
+  matrix_lut_stale = true;
+  fillImage(1);
+}
+
+void tearDown() {}
+
+static void test_scan_matches_draw_pixel() {
+  static const int rotations[] = {0, 90, 180, 270};
+  for (int i = 0; i < 4; i++) {
+    renderFrame(rotations[i]);
+
+    static uint16_t expect[IMAGE_PIXELS];
+    for (int y = 0; y < IMAGE_HEIGHT; y++) {
+      for (int x = 0; x < IMAGE_WIDTH; x++) {
+        const uint8_t* rgb = (*image_bin)[y][x];
+        uint16_t color = matrix_lut_red[rgb[0]] | matrix_lut_green[rgb[1]] |
+                         matrix_lut_blue[rgb[2]];
+        drawPixelLegacy(expect, i, x, y, color);
+      }
+    }
+    TEST_ASSERT_EQUAL_MEMORY(expect, matrix.getShownBuffer(), sizeof(expect));
+  }
+}
+
+static void test_only_dirty_rows_are_drawn() {
+  renderFrame(0);
+  static uint16_t before[IMAGE_PIXELS];
+  memcpy(before, matrix.getShownBuffer(), sizeof(before));
+
+  fillImage(2);
+  markRowsDirty(10, 12);
+  loopMatrix();
+  const uint16_t* shown = matrix.getShownBuffer();
+  TEST_ASSERT_EQUAL_MEMORY(before, shown, 10 * IMAGE_WIDTH * 2);
+  TEST_ASSERT_EQUAL_MEMORY(before + 12 * IMAGE_WIDTH, shown + 12 * IMAGE_WIDTH,
+                           (IMAGE_HEIGHT - 12) * IMAGE_WIDTH * 2);
+}
+
+// Both paths end with show(), which the device spends converting the canvas
+// into bitplanes, so the figures compare the whole refresh.
+static void test_benchmark_render() {
+  uint64_t legacy = 0;
+  uint64_t lut = 0;
+  for (int i = 0; i < RENDER_BENCH_FRAMES; i++) {
+    uint32_t begin = HotPathProfiler::now();
+    renderLegacy(matrix.getBuffer(), 0, settings.gain);
+    matrix.show();
+    legacy += HotPathProfiler::now() - begin;
+
+    begin = HotPathProfiler::now();
+    renderFrame(0);
+    lut += HotPathProfiler::now() - begin;
+  }
+  testReport("legacy render %.1f us/frame", ticksToMicros(legacy) /
+                                                RENDER_BENCH_FRAMES);
+  testReport("lut render %.1f us/frame (%.1fx)",
+             ticksToMicros(lut) / RENDER_BENCH_FRAMES,
+             (double)legacy / lut);
+}
+
+int main() {
+  beginFirmwareTest();
+  UNITY_BEGIN();
+  RUN_TEST(test_scan_matches_draw_pixel);
+  RUN_TEST(test_only_dirty_rows_are_drawn);
+  RUN_TEST(test_benchmark_render);
+  return UNITY_END();
+}
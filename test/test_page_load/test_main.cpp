@@ -0,0 +1,130 @@
+// Times loading the web UI the way a browser does: the page, then its assets,
+// then the API requests its script makes at startup, each stage in parallel
+// over a few persistent connections. The server is polled at the WiFi task's
+// periods, so the figures show how many polls a page load takes.
+
+#include <vector>
+
+#include "../HttpHarness.hh"
+
+#define PAGE_LOAD_BENCH_LOADS (20)
+
+// Browsers open up to six connections to a host.
+#define PAGE_LOAD_CONNECTIONS (6)
+
+// The WiFi task period when nothing is in progress.
+#define PAGE_LOAD_IDLE_PERIOD_MS (50)
+
+static const char* const api_paths[] = {"/api/image", "/api/gain",
+                                        "/api/time"};
+
+struct PageLoad {
+  int fds[PAGE_LOAD_CONNECTIONS];
+  std::string pending[PAGE_LOAD_CONNECTIONS];
+  unsigned long request_us;
+  unsigned long requests;
+  bool ok;
+};
+
+// Fetches the paths in parallel, one per connection, opening connections as
+// they are first needed.
+static void fetchStage(PageLoad* load, const std::vector<const char*>& paths) {
+  std::vector<std::thread> threads;
+  std::vector<unsigned long> elapsed(paths.size());
+  std::vector<char> ok(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    threads.emplace_back([load, &paths, &elapsed, &ok, i]() {
+      unsigned long begin = micros();
+      int& fd = load->fds[i % PAGE_LOAD_CONNECTIONS];
+      if (fd < 0) {
+        fd = connectHttp();
+      }
+      HttpReply reply;
+      ok[i] = fd >= 0 &&
+              sendAll(fd, httpRequest("GET", paths[i],
+                                      "Accept-Encoding: gzip, deflate\r\n")) &&
+              readHttpReply(fd, &reply, &load->pending[i]) &&
+              reply.status == 200;
+      elapsed[i] = micros() - begin;
+    });
+  }
+  for (size_t i = 0; i < paths.size(); i++) {
+    threads[i].join();
+    load->request_us += elapsed[i];
+    load->requests++;
+    load->ok &= ok[i];
+  }
+}
+
+static unsigned long loadPage(PageLoad* load) {
+  for (int& fd : load->fds) {
+    fd = -1;
+  }
+  load->ok = true;
+
+  std::vector<const char*> assets;
+  for (const site_entry* file = site_table; file->name; file++) {
+    if (strncmp(file->name, "/assets/", 8) == 0) {
+      assets.push_back(file->name);
+    }
+  }
+
+  unsigned long begin = micros();
+  fetchStage(load, {"/"});
+  fetchStage(load, assets);
+  fetchStage(load, std::vector<const char*>(
+                       api_paths, api_paths + sizeof(api_paths) /
+                                                  sizeof(api_paths[0])));
+  unsigned long elapsed = micros() - begin;
+
+  for (int fd : load->fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  return elapsed;
+}
+
+HttpServerThread server;
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_page_loads() {
+  server.start(0, 0);
+  PageLoad load = {};
+  loadPage(&load);
+  server.stop();
+  TEST_ASSERT_TRUE(load.ok);
+  for (bool used : http_buffer_used) {
+    TEST_ASSERT_FALSE(used);
+  }
+}
+
+static void test_benchmark_page_load() {
+  server.start(HTTP_BUSY_PERIOD_MS, PAGE_LOAD_IDLE_PERIOD_MS);
+  PageLoad load = {};
+  unsigned long total_us = 0;
+  unsigned long max_us = 0;
+  for (int i = 0; i < PAGE_LOAD_BENCH_LOADS; i++) {
+    unsigned long elapsed = loadPage(&load);
+    total_us += elapsed;
+    max_us = max(max_us, elapsed);
+  }
+  server.stop();
+  TEST_ASSERT_TRUE(load.ok);
+
+  testReport("%d connections, %d buffers", HTTP_CONNECTIONS, HTTP_BUFFERS);
+  testReport("page load %.1f ms mean, %.1f ms max",
+             total_us / 1e3 / PAGE_LOAD_BENCH_LOADS, max_us / 1e3);
+  testReport("request %.1f ms mean", load.request_us / 1e3 / load.requests);
+}
+
+int main() {
+  beginFirmwareTest();
+  UNITY_BEGIN();
+  RUN_TEST(test_page_loads);
+  RUN_TEST(test_benchmark_page_load);
+  return UNITY_END();
+}
@@ -0,0 +1,192 @@
+// Feeds a corpus of requests to the server in one piece, a byte at a time, and
+// in random pieces, and checks that the replies are the same however the
+// bytes arrive. Then compares the parsing cost of long headers fed a byte at
+// a time against in one piece.
+
+#include <vector>
+
+#include "../HttpHarness.hh"
+
+#define PARSER_RANDOM_SPLITS (20)
+#define PARSER_BENCH_REQUESTS (50)
+
+#define AUTH "Authorization: " HTTP_TEST_AUTH "\r\n"
+
+// Headers that fill the connection buffer without ending.
+static std::string oversizeRequest() {
+  std::string request = "GET /api/rotation HTTP/1.1\r\nX-Pad: ";
+  request.append(HTTP_BUFFER_SIZE - request.size(), 'a');
+  return request;
+}
+
+struct ParserCase {
+  const char* name;
+  std::string request;
+  std::vector<int> statuses;
+  // The Connection header of the last reply.
+  const char* connection;
+};
+
+static std::vector<ParserCase> corpus() {
+  return {
+      {"simple", "GET /api/rotation HTTP/1.1\r\n" AUTH "\r\n", {200},
+       "keep-alive"},
+      {"bare lf", "GET /api/rotation HTTP/1.1\n" AUTH "\n", {200},
+       "keep-alive"},
+      {"mixed line ends",
+       "GET /api/rotation HTTP/1.1\r\nHost: billboard\n" AUTH "\n", {200},
+       "keep-alive"},
+      {"case and whitespace",
+       "GET /api/rotation HTTP/1.1\r\nAUTHORIZATION:  \t " HTTP_TEST_AUTH
+       " \t\r\nconnection:CLOSE\r\n\r\n",
+       {200}, "close"},
+      {"leading blank lines",
+       "\r\n\r\nGET /api/rotation HTTP/1.1\r\n" AUTH "\r\n", {200},
+       "keep-alive"},
+      {"folded header",
+       "GET /api/rotation HTTP/1.1\r\n" AUTH "Connection:\r\n  \t\r\n"
+       "\tclose\r\n\r\n",
+       {200}, "close"},
+      {"folded unknown header",
+       "GET /api/rotation HTTP/1.1\r\nX-Long: a\r\n b\r\n c\r\n" AUTH "\r\n",
+       {200}, "keep-alive"},
+      {"pipelined",
+       "GET /api/rotation HTTP/1.1\r\n" AUTH "\r\n"
+       "GET /api/rotation HTTP/1.1\r\n" AUTH "\r\n"
+       "GET /api/rotation HTTP/1.1\r\n" AUTH "Connection: close\r\n\r\n",
+       {200, 200, 200}, "close"},
+      {"http/1.0", "GET /api/rotation HTTP/1.0\r\n" AUTH "\r\n", {200},
+       "close"},
+      {"no credentials", "GET /api/rotation HTTP/1.1\r\n\r\n", {401},
+       "keep-alive"},
+      {"bad request line", "GET/api/rotation\r\n\r\n", {400}, "close"},
+      {"unknown method", "DELETE /api/rotation HTTP/1.1\r\n" AUTH "\r\n",
+       {405}, "keep-alive"},
+      {"oversize headers", oversizeRequest(), {431}, "close"},
+  };
+}
+
+// Sends the request in pieces of the given sizes, repeating the last, and
+// calling loopHttp() after each. Returns the replies.
+static std::vector<HttpReply> feed(const std::string& request,
+                                   size_t replies,
+                                   const std::vector<size_t>& sizes) {
+  int fd = connectHttp();
+  size_t pos = 0;
+  for (size_t i = 0; pos < request.size(); i++) {
+    size_t n = min(sizes[min(i, sizes.size() - 1)], request.size() - pos);
+    sendAll(fd, request.data() + pos, n);
+    pos += n;
+    loopHttp();
+  }
+
+  std::vector<HttpReply> result(replies);
+  std::string pending;
+  for (HttpReply& reply : result) {
+    readHttpReply(fd, &reply, &pending, true);
+  }
+  close(fd);
+  resetHttpServer();
+  return result;
+}
+
+static std::vector<size_t> randomSizes(uint32_t* seed, size_t total) {
+  std::vector<size_t> sizes;
+  for (size_t n = 0; n < total;) {
+    *seed = *seed * 1103515245 + 12345;
+    sizes.push_back(1 + (*seed >> 16) % 64);
+    n += sizes.back();
+  }
+  return sizes;
+}
+
+static void checkReplies(const ParserCase& c,
+                         const std::vector<HttpReply>& expect,
+                         const std::vector<HttpReply>& actual) {
+  for (size_t i = 0; i < expect.size(); i++) {
+    TEST_ASSERT_EQUAL_MESSAGE(expect[i].status, actual[i].status, c.name);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(expect[i].headers.c_str(),
+                                     actual[i].headers.c_str(), c.name);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(expect[i].body.c_str(),
+                                     actual[i].body.c_str(), c.name);
+  }
+}
+
+void setUp() {}
+
+void tearDown() {
+  resetHttpServer();
+}
+
+static void test_corpus_in_one_piece() {
+  for (const ParserCase& c : corpus()) {
+    std::vector<HttpReply> replies =
+        feed(c.request, c.statuses.size(), {c.request.size()});
+    for (size_t i = 0; i < c.statuses.size(); i++) {
+      TEST_ASSERT_EQUAL_MESSAGE(c.statuses[i], replies[i].status, c.name);
+    }
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(
+        c.connection, replies.back().header("Connection").c_str(), c.name);
+  }
+}
+
+static void test_corpus_byte_by_byte() {
+  for (const ParserCase& c : corpus()) {
+    size_t count = c.statuses.size();
+    checkReplies(c, feed(c.request, count, {c.request.size()}),
+                 feed(c.request, count, {1}));
+  }
+}
+
+static void test_corpus_random_pieces() {
+  uint32_t seed = 1;
+  for (const ParserCase& c : corpus()) {
+    size_t count = c.statuses.size();
+    std::vector<HttpReply> expect = feed(c.request, count, {c.request.size()});
+    for (int i = 0; i < PARSER_RANDOM_SPLITS; i++) {
+      std::vector<size_t> sizes = randomSizes(&seed, c.request.size());
+      checkReplies(c, expect, feed(c.request, count, sizes));
+    }
+  }
+}
+
+// Returns the mean time spent reading and parsing a request with headers of
+// about the given size.
+static double timeRequest(size_t header_bytes, size_t piece) {
+  std::string request = "GET /api/rotation HTTP/1.1\r\n" AUTH;
+  while (request.size() < header_bytes) {
+    request += "X-Header-" + std::to_string(request.size()) + ": " +
+               std::string(60, 'v') + "\r\n";
+  }
+  request += "\r\n";
+
+  profiler = HotPathProfiler();
+  for (int i = 0; i < PARSER_BENCH_REQUESTS; i++) {
+    feed(request, 1, {piece});
+  }
+  return ticksToMicros(profiler.entry(PROFILE_HTTP_READ).sum) /
+         PARSER_BENCH_REQUESTS;
+}
+
+// Parsing cost per byte should not grow with the size of the headers.
+static void test_benchmark_parse() {
+  static const size_t sizes[] = {256, 1024, 1900};
+  for (size_t size : sizes) {
+    double bulk = timeRequest(size, HTTP_BUFFER_SIZE);
+    double bytes = timeRequest(size, 1);
+    testReport("%4zu byte headers: %6.1f us in one piece, %7.1f us a byte at "
+               "a time (%.3f us/byte)",
+               size, bulk, bytes, bytes / size);
+  }
+}
+
+int main() {
+  beginFirmwareTest();
+  beginHttpServer();
+  UNITY_BEGIN();
+  RUN_TEST(test_corpus_in_one_piece);
+  RUN_TEST(test_corpus_byte_by_byte);
+  RUN_TEST(test_corpus_random_pieces);
+  RUN_TEST(test_benchmark_parse);
+  return UNITY_END();
+}
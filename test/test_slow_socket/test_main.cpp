@@ -0,0 +1,130 @@
+// Downloads the image through small socket buffers at several read rates, as
+// a slow WiFi client would, and reports how the adaptive write loop copes.
+// The server is polled at the WiFi task's periods, as on the device.
+
+#include "../HttpHarness.hh"
+
+#define SLOW_SOCKET_BUFFER "4096"
+#define SLOW_SOCKET_RCVBUF (4096)
+#define SLOW_SOCKET_REPLIES (3)
+
+// The WiFi task period when nothing is in progress.
+#define SLOW_SOCKET_IDLE_PERIOD_MS (50)
+
+HttpServerThread server;
+
+static uint8_t expect[IMAGE_FILE_SIZE];
+
+static void clearTransmitStats() {
+  for (HttpServerConnection& connection : http_connections) {
+    connection.tx_replies = 0;
+    connection.tx_bytes = 0;
+    connection.tx_us = 0;
+    connection.tx_short_writes = 0;
+    connection.tx_stalls = 0;
+  }
+}
+
+// Reads one reply at no more than rate bytes per second, or as fast as it
+// arrives if the rate is zero.
+static bool readSlowly(int fd, unsigned long rate, std::string* body) {
+  std::string in;
+  unsigned long begin = micros();
+  size_t length = SIZE_MAX;
+  size_t header_end = 0;
+  while (in.size() < header_end + length) {
+    char buf[512];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      return false;
+    }
+    in.append(buf, n);
+
+    if (!header_end && in.find("\r\n\r\n") != std::string::npos) {
+      header_end = in.find("\r\n\r\n") + 4;
+      HttpReply reply;
+      reply.headers = in.substr(0, header_end - 2);
+      length = atol(reply.header("Content-Length").c_str());
+    }
+
+    if (rate) {
+      unsigned long due = begin + in.size() * 1000000ull / rate;
+      long ahead = due - micros();
+      if (ahead > 0) {
+        usleep(ahead);
+      }
+    }
+  }
+  *body = in.substr(header_end);
+  return true;
+}
+
+void setUp() {
+  for (int y = 0; y < IMAGE_HEIGHT; y++) {
+    for (int x = 0; x < IMAGE_WIDTH; x++) {
+      (*image_bin)[y][x][0] = x * 4;
+      (*image_bin)[y][x][1] = y * 4;
+      (*image_bin)[y][x][2] = x ^ y;
+    }
+    expandImageRow(image_bin, y, expect + y * IMAGE_WIDTH * 4);
+  }
+  clearTransmitStats();
+}
+
+void tearDown() {}
+
+static void test_slow_reads() {
+  static const unsigned long rates[] = {16000, 64000, 256000, 0};
+  for (unsigned long rate : rates) {
+    clearTransmitStats();
+    server.start(HTTP_BUSY_PERIOD_MS, SLOW_SOCKET_IDLE_PERIOD_MS);
+    int fd = connectHttp(10000, SLOW_SOCKET_RCVBUF);
+    unsigned long begin = micros();
+    for (int i = 0; i < SLOW_SOCKET_REPLIES; i++) {
+      std::string body;
+      TEST_ASSERT_TRUE(sendAll(fd, httpRequest("GET", "/api/image")));
+      TEST_ASSERT_TRUE(readSlowly(fd, rate, &body));
+      TEST_ASSERT_EQUAL(sizeof(expect), body.size());
+      TEST_ASSERT_EQUAL_MEMORY(expect, body.data(), sizeof(expect));
+    }
+    unsigned long elapsed = micros() - begin;
+    close(fd);
+    server.stop();
+
+    unsigned long replies = 0;
+    uint64_t bytes = 0;
+    uint64_t us = 0;
+    unsigned long short_writes = 0;
+    unsigned long stalls = 0;
+    size_t chunk = 0;
+    for (const HttpServerConnection& connection : http_connections) {
+      replies += connection.tx_replies;
+      bytes += connection.tx_bytes;
+      us += connection.tx_us;
+      short_writes += connection.tx_short_writes;
+      stalls += connection.tx_stalls;
+      if (connection.tx_replies) {
+        chunk = connection.tx_chunk;
+      }
+    }
+    TEST_ASSERT_EQUAL(SLOW_SOCKET_REPLIES, replies);
+
+    char limit[16] = "unlimited";
+    if (rate) {
+      snprintf(limit, sizeof(limit), "%lu KB/s", rate / 1000);
+    }
+    testReport("read %-9s: %4.0f KB/s received, %4.0f KB/s sent, %3lu short "
+               "writes, %3lu stalls, chunk %zu",
+               limit, SLOW_SOCKET_REPLIES * sizeof(expect) * 1e3 / elapsed,
+               us ? bytes * 1e3 / us : 0.0, short_writes, stalls, chunk);
+  }
+}
+
+int main() {
+  // As little as the kernel allows, which is still more than the ESP32.
+  setenv("BILLBOARD_SOCKET_BUFFER", SLOW_SOCKET_BUFFER, 1);
+  beginFirmwareTest();
+  UNITY_BEGIN();
+  RUN_TEST(test_slow_reads);
+  return UNITY_END();
+}
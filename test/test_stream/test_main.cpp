@@ -0,0 +1,240 @@
+// Sends DDP packets to the firmware over loopback UDP, as xLights or WLED
+// would, and checks how frames are assembled and how duplicate, reordered
+// and truncated packets are counted. Then streams at 60 frames per second
+// while polling at the busy WiFi period, and reports the latency from the
+// first packet of a frame until it is on screen, and how many are dropped.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../Firmware.hh"
+
+// The most RGB data xLights puts in one packet.
+#define STREAM_PACKET_DATA (1440)
+#define STREAM_BENCH_FPS (60)
+#define STREAM_BENCH_FRAMES (120)
+// Marks the first pixel of a benchmark frame, which holds its index.
+#define STREAM_BENCH_MARK (0xa5)
+
+static int sender = -1;
+
+static std::string ddpPacket(uint8_t flags,
+                             uint8_t sequence,
+                             uint32_t offset,
+                             const uint8_t* data,
+                             size_t length) {
+  uint8_t header[DDP_HEADER_SIZE] = {
+      (uint8_t)(DDP_FLAGS_VERSION_1 | flags),
+      sequence,
+      0x01,
+      DDP_ID_DISPLAY,
+      (uint8_t)(offset >> 24),
+      (uint8_t)(offset >> 16),
+      (uint8_t)(offset >> 8),
+      (uint8_t)offset,
+      (uint8_t)(length >> 8),
+      (uint8_t)length,
+  };
+  std::string packet(reinterpret_cast<const char*>(header), sizeof(header));
+  packet.append(reinterpret_cast<const char*>(data), length);
+  return packet;
+}
+
+static void sendPacket(const std::string& packet) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(DDP_PORT);
+  sendto(sender, packet.data(), packet.size(), 0,
+         reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+}
+
+// Sends a whole frame in packets of STREAM_PACKET_DATA bytes, pushing it
+// with the last. Returns the next sequence number.
+static uint8_t sendFrame(const uint8_t* frame, uint8_t sequence) {
+  for (size_t offset = 0; offset < sizeof(Image);
+       offset += STREAM_PACKET_DATA) {
+    size_t length = min((size_t)STREAM_PACKET_DATA, sizeof(Image) - offset);
+    bool last = offset + length == sizeof(Image);
+    sendPacket(ddpPacket(last ? DDP_FLAGS_PUSH : 0, sequence, offset,
+                         frame + offset, length));
+    sequence = sequence % DDP_SEQUENCE_COUNT + 1;
+  }
+  return sequence;
+}
+
+// Sends one pixel of the first row, at x.
+static void sendPixel(uint8_t flags, uint8_t sequence, int x, uint8_t value) {
+  uint8_t pixel[3] = {value, value, value};
+  sendPacket(ddpPacket(flags, sequence, x * 3, pixel, sizeof(pixel)));
+}
+
+// Gives the loopback socket a moment, then reads what has arrived.
+static void pollStream() {
+  usleep(1000);
+  loopStream();
+}
+
+void setUp() {
+  image_back_owner = NULL;
+  memset(image_bin, 0, sizeof(Image));
+  memset(image_back, 0, sizeof(Image));
+  stream_packets = 0;
+  stream_packets_lost = 0;
+  stream_packets_duplicate = 0;
+  stream_packets_rejected = 0;
+  stream_frames = 0;
+}
+
+void tearDown() {}
+
+static void test_frame_presented() {
+  static Image frame;
+  for (size_t i = 0; i < sizeof(Image); i++) {
+    (&frame[0][0][0])[i] = i * 7;
+  }
+  sendFrame(&frame[0][0][0], 1);
+  pollStream();
+  TEST_ASSERT_EQUAL(1, stream_frames);
+  TEST_ASSERT_EQUAL(0, stream_packets_lost);
+  TEST_ASSERT_EQUAL_MEMORY(frame, image_bin, sizeof(Image));
+}
+
+static void test_gap_counted_lost() {
+  sendPixel(0, 1, 0, 1);
+  sendPixel(0, 4, 1, 2);
+  sendPixel(DDP_FLAGS_PUSH, 5, 2, 3);
+  pollStream();
+  TEST_ASSERT_EQUAL(2, stream_packets_lost);
+  TEST_ASSERT_EQUAL(1, stream_frames);
+}
+
+static void test_duplicate_not_lost() {
+  sendPixel(0, 1, 0, 1);
+  sendPixel(DDP_FLAGS_PUSH, 1, 1, 2);
+  sendPixel(DDP_FLAGS_PUSH, 2, 2, 3);
+  pollStream();
+  TEST_ASSERT_EQUAL(0, stream_packets_lost);
+  TEST_ASSERT_EQUAL(1, stream_packets_duplicate);
+  // The duplicate is dropped, push and all.
+  TEST_ASSERT_EQUAL(1, stream_frames);
+  TEST_ASSERT_EQUAL(0, (*image_bin)[0][1][0]);
+  TEST_ASSERT_EQUAL(3, (*image_bin)[0][2][0]);
+}
+
+static void test_reordered_not_lost() {
+  sendPixel(0, 14, 0, 1);
+  sendPixel(0, 1, 1, 2);
+  sendPixel(0, 15, 2, 3);
+  sendPixel(DDP_FLAGS_PUSH, 2, 3, 4);
+  pollStream();
+  TEST_ASSERT_EQUAL(0, stream_packets_lost);
+  TEST_ASSERT_EQUAL(1, stream_frames);
+  for (int x = 0; x < 4; x++) {
+    TEST_ASSERT_EQUAL(x + 1, (*image_bin)[0][x][0]);
+  }
+}
+
+// Streamed frames are never saved, even within a second of an upload.
+static void test_pending_save_cancelled() {
+  scheduler.schedule(TASK_SAVE_IMAGE, 1000);
+  sendPixel(DDP_FLAGS_PUSH, 1, 0, 1);
+  pollStream();
+  TEST_ASSERT_EQUAL(1, stream_frames);
+  TEST_ASSERT_FALSE(scheduler.task(TASK_SAVE_IMAGE).scheduled);
+}
+
+static void test_short_read_rejected() {
+  uint8_t data[STREAM_PACKET_DATA];
+  memset(data, 0x77, sizeof(data));
+  stream_udp.truncateNextPacket(DDP_HEADER_SIZE + sizeof(data) / 2);
+  sendPacket(ddpPacket(DDP_FLAGS_PUSH, 1, 0, data, sizeof(data)));
+  pollStream();
+  TEST_ASSERT_EQUAL(1, stream_packets);
+  TEST_ASSERT_EQUAL(1, stream_packets_rejected);
+  TEST_ASSERT_EQUAL(0, stream_frames);
+  TEST_ASSERT_EQUAL_MEMORY(image_bin, image_back, sizeof(Image));
+  TEST_ASSERT_EACH_EQUAL_UINT8(0, &(*image_bin)[0][0][0], sizeof(data));
+}
+
+static void test_benchmark_stream() {
+  std::vector<unsigned long> sent_us(STREAM_BENCH_FRAMES);
+  std::vector<unsigned long> shown_us(STREAM_BENCH_FRAMES);
+  std::vector<bool> shown(STREAM_BENCH_FRAMES);
+
+  std::thread thread([&sent_us]() {
+    static Image frame;
+    uint8_t sequence = 1;
+    unsigned long begin = micros();
+    for (int i = 0; i < STREAM_BENCH_FRAMES; i++) {
+      unsigned long due = begin + i * 1000000ul / STREAM_BENCH_FPS;
+      long ahead = due - micros();
+      if (ahead > 0) {
+        usleep(ahead);
+      }
+      memset(frame, i, sizeof(frame));
+      frame[0][0][0] = STREAM_BENCH_MARK;
+      frame[0][0][1] = i;
+      sent_us[i] = micros();
+      sequence = sendFrame(&frame[0][0][0], sequence);
+    }
+  });
+
+  // Poll as the WiFi task does while a stream is in progress.
+  unsigned long end = millis() + STREAM_BENCH_FRAMES * 1000 / STREAM_BENCH_FPS +
+                      500;
+  while ((long)(end - millis()) > 0) {
+    unsigned long frames = stream_frames;
+    loopStream();
+    if (stream_frames != frames &&
+        (*image_bin)[0][0][0] == STREAM_BENCH_MARK) {
+      int i = (*image_bin)[0][0][1];
+      shown[i] = true;
+      shown_us[i] = micros();
+    }
+    usleep(HTTP_BUSY_PERIOD_MS * 1000);
+  }
+  thread.join();
+
+  int count = 0;
+  uint64_t sum_us = 0;
+  unsigned long max_us = 0;
+  for (int i = 0; i < STREAM_BENCH_FRAMES; i++) {
+    if (shown[i]) {
+      unsigned long latency = shown_us[i] - sent_us[i];
+      count++;
+      sum_us += latency;
+      max_us = max(max_us, latency);
+    }
+  }
+  TEST_ASSERT_GREATER_THAN(0, count);
+  int dropped = STREAM_BENCH_FRAMES - count;
+  testReport("%d frames at %d fps: latency %.0f us avg, %lu us max, %.1f%% "
+             "frames dropped, %lu packets lost",
+             STREAM_BENCH_FRAMES, STREAM_BENCH_FPS, (double)sum_us / count,
+             max_us, 100.0 * dropped / STREAM_BENCH_FRAMES,
+             stream_packets_lost);
+}
+
+int main() {
+  beginFirmwareTest();
+  stream_udp.begin(DDP_PORT);
+  sender = socket(AF_INET, SOCK_DGRAM, 0);
+  UNITY_BEGIN();
+  RUN_TEST(test_frame_presented);
+  RUN_TEST(test_gap_counted_lost);
+  RUN_TEST(test_duplicate_not_lost);
+  RUN_TEST(test_reordered_not_lost);
+  RUN_TEST(test_pending_save_cancelled);
+  RUN_TEST(test_short_read_rejected);
+  RUN_TEST(test_benchmark_stream);
+  int result = UNITY_END();
+  close(sender);
+  return result;
+}